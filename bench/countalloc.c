@@ -0,0 +1,60 @@
+/*  Contatore delle allocazioni sullo heap, da caricare con LD_PRELOAD=./countalloc.so
+ *  Intercetta malloc, calloc, realloc e le allocazioni allineate (quindi anche new e le slab
+ *  di BumpPtrAllocator) e stampa il totale su stderr all'uscita del processo.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t align, size_t size);
+
+static unsigned long allocations;
+
+static void count(void)
+{
+  __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+}
+
+void *malloc(size_t size)
+{
+  count();
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size)
+{
+  count();
+  return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+  count();
+  return __libc_realloc(ptr, size);
+}
+
+void *memalign(size_t align, size_t size)
+{
+  count();
+  return __libc_memalign(align, size);
+}
+
+void *aligned_alloc(size_t align, size_t size)
+{
+  count();
+  return __libc_memalign(align, size);
+}
+
+int posix_memalign(void **ptr, size_t align, size_t size)
+{
+  count();
+  *ptr = __libc_memalign(align, size);
+  return *ptr ? 0 : 12; /* ENOMEM */
+}
+
+__attribute__((destructor)) static void report(void)
+{
+  fprintf(stderr, "heap allocations: %lu\n", allocations);
+}
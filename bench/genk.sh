@@ -0,0 +1,29 @@
+#!/bin/bash
+# Generatore di sorgenti kaleidoscope di grandi dimensioni per i benchmark del front-end
+#   genk.sh defs <N>    N funzioni con variabili locali, un ciclo for e un if (molti nodi dell'AST)
+#   genk.sh stmts <N>   una sola funzione il cui blocco contiene N istruzioni (liste del parser)
+
+case $1 in
+  defs)
+    awk -v n=$2 'BEGIN {
+      for (i = 0; i < n; i++) {
+        printf "def f%d(x y) {\n", i
+        printf "   var a = x*2 + y;\n"
+        printf "   var s = 0;\n"
+        printf "   for (var k = 0; k < a; k++) s = s + k*x - y/2;\n"
+        printf "   if (s > a) a = s - 1 else a = s + 1;\n"
+        printf "   a*s + %d\n", i
+        printf "};\n"
+      }
+    }' ;;
+  stmts)
+    awk -v n=$2 'BEGIN {
+      printf "def big(x) {\n   var a = x;\n"
+      for (i = 0; i < n; i++)
+        printf "   a = %s;\n", i % 2 ? "a*2 - " i : "a + " i
+      printf "   a\n};\n"
+    }' ;;
+  *)
+    echo "uso: genk.sh defs|stmts <N>" >&2
+    exit 1 ;;
+esac
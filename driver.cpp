@@ -1,10 +1,6 @@
 #include "driver.hpp"
 #include "parser.hpp"
 
-LLVMContext *context = new LLVMContext;
-Module *module = new Module("Kaleidoscope", *context);
-IRBuilder<> *builder = new IRBuilder(*context);
-
 Value *LogErrorV(const std::string Str)
 {
   std::cerr << Str << std::endl;
@@ -23,50 +19,1100 @@ Value *LogErrorV(const std::string Str)
    interferire con il builder globale, la generazione viene dunque effettuata
    con un builder temporaneo TmpB
 */
-static AllocaInst *CreateEntryBlockAlloca(Function *fun, StringRef VarName, Type *type = Type::getDoubleTy(*context))
+static AllocaInst *CreateEntryBlockAlloca(Function *fun, StringRef VarName, Type *type = nullptr)
 {
+  if (!type)
+    type = Type::getDoubleTy(fun->getContext());
   IRBuilder<> TmpB(&fun->getEntryBlock(), fun->getEntryBlock().begin());
   return TmpB.CreateAlloca(type, nullptr, VarName);
 }
 
-driver::driver() : trace_parsing(false), trace_scanning(false) {};
-
-int driver::parse(const std::string &f)
+/*  Ogni driver possiede il proprio LLVMContext, il proprio modulo e il proprio builder, oltre allo
+ *  stato dello scanner (rientrante): più driver possono quindi compilare file diversi in parallelo
+ *  su thread diversi senza condividere nulla.
+ */
+driver::driver() : context(std::make_unique<LLVMContext>()),
+                   module(std::make_unique<Module>("Kaleidoscope", *context)),
+                   builder(std::make_unique<IRBuilder<>>(*context)),
+                   trace_parsing(false), trace_scanning(false), scanner(nullptr),
+                   inputMap(nullptr), inputLength(0),
+                   optLevel(0), fastMath(false), fpContractFast(false), builtins(true), inlineThreshold(25), tailRecurse(nullptr), emitKind(EMIT_IR), cpu("generic"), timeTrace(false), profile(false), profileCycles(false), pgoGen(false), lto(false) {};
+
+// copia le opzioni di compilazione (non lo stato) da un altro driver, per le unità compilate con -j
+void driver::inheritOptions(const driver &parent)
+{
+  trace_parsing = parent.trace_parsing;
+  trace_scanning = parent.trace_scanning;
+  optLevel = parent.optLevel;
+  fastMath = parent.fastMath;
+  fpContractFast = parent.fpContractFast;
+  builtins = parent.builtins;
+  emitKind = parent.emitKind;
+  outputFile = parent.outputFile;
+  cpu = parent.cpu;
+  hostSymbols = parent.hostSymbols;
+  stats.enabled = parent.stats.enabled;
+  timeTrace = parent.timeTrace;
+  profile = parent.profile;
+  profileCycles = parent.profileCycles;
+  pgoGen = parent.pgoGen;
+  pgoGenFile = parent.pgoGenFile;
+  pgoUse = parent.pgoUse;
+  inlineThreshold = parent.inlineThreshold;
+  lto = parent.lto;
+  exports = parent.exports;
+  cache = parent.cache;
+}
+
+/*  L'inizializzazione dei target registra variabili globali di LLVM: viene eseguita una volta sola
+ *  per processo, anche quando più driver lavorano su thread diversi.
+ */
+static void InitializeNative()
+{
+  static std::once_flag flag;
+  std::call_once(flag, []
+                 {
+    InitializeNativeTarget();
+    InitializeNativeTargetAsmPrinter(); });
+}
+
+int driver::parse(const std::string &f)
+{
+  file = f;
+  location.initialize(&file);
+  lineStarts.clear();
+  PhaseTimer timer(stats, "parse");
+  scan_begin();
+  yy::parser parser(*this);
+  parser.set_debug_level(trace_parsing);
+  int res = parser.parse();
+  scan_end();
+  return res;
+}
+
+void driver::codegen()
+{
+  // l'albero viene prima semplificato, poi si genera il codice a partire dal nodo radice
+  {
+    PhaseTimer timer(stats, "simplify");
+    root = root->simplify(*this);
+  }
+  {
+    PhaseTimer timer(stats, "codegen");
+    root->codegen(*this);
+  }
+  if (stats.enabled)
+  {
+    stats.astNodes += arena.getNodeCount();
+    stats.astBytes += arena.getBytesAllocated();
+    stats.astAllocations += arena.getSlabCount();
+  }
+
+  // terminata la generazione, l'albero non serve più e viene liberato per intero
+  inlineBodies.clear();
+  arena.release();
+  root = nullptr;
+};
+
+/*  Interning degli identificatori
+ *  Lo scanner passa ogni identificatore da questa tabella: a ogni nome distinto corrisponde un id
+ *  progressivo, e il nome resta memorizzato una sola volta nella chiave della StringMap.
+ */
+Symbol driver::intern(StringRef name)
+{
+  auto entry = symbolIds.try_emplace(name, symbolIds.size());
+  return Symbol{entry.first->second, entry.first->getKey()};
+}
+
+/*  Funzioni e variabili globali sono memorizzate anche per id di simbolo: dopo la prima ricerca
+ *  nel modulo, CallExprAST, VariableExprAST e AssignmentExprAST le trovano con un accesso
+ *  a vettore, senza calcolare di nuovo l'hash del nome.
+ */
+Function *driver::lookupFunction(const Symbol &S)
+{
+  if (S.id < functions.size() && functions[S.id])
+    return functions[S.id];
+  Function *F = module->getFunction(S.name);
+  if (F)
+    bindFunction(S, F);
+  return F;
+}
+
+GlobalVariable *driver::lookupGlobal(const Symbol &S)
+{
+  if (S.id < globals.size() && globals[S.id])
+    return globals[S.id];
+  GlobalVariable *G = module->getNamedGlobal(S.name);
+  if (G)
+    bindGlobal(S, G);
+  return G;
+}
+
+void driver::bindFunction(const Symbol &S, Function *F)
+{
+  if (S.id >= functions.size())
+    functions.resize(S.id + 1, nullptr);
+  functions[S.id] = F;
+}
+
+// funzioni espandibili in linea del file in compilazione: il loro AST vive fino alla fine di codegen()
+FunctionAST *driver::lookupInline(const Symbol &S) const
+{
+  return S.id < inlineBodies.size() ? inlineBodies[S.id] : nullptr;
+}
+
+void driver::bindInline(const Symbol &S, FunctionAST *F)
+{
+  if (S.id >= inlineBodies.size())
+    inlineBodies.resize(S.id + 1, nullptr);
+  inlineBodies[S.id] = F;
+}
+
+void driver::bindGlobal(const Symbol &S, GlobalVariable *G)
+{
+  if (S.id >= globals.size())
+    globals.resize(S.id + 1, nullptr);
+  globals[S.id] = G;
+}
+
+void SymbolTable::enterScope()
+{
+  scopes.push_back(shadowed.size());
+}
+
+void SymbolTable::exitScope()
+{
+  size_t mark = scopes.back();
+  scopes.pop_back();
+  while (shadowed.size() > mark)
+  {
+    bindings[shadowed.back().first] = shadowed.back().second;
+    shadowed.pop_back();
+  }
+}
+
+// la barriera ricorda la funzione esterna e da dove ripartono, in shadowed, i binding della nuova
+void SymbolTable::enterFunction()
+{
+  enterScope();
+  frames.emplace_back(frame, shadowed.size());
+  frame = ++frameCount;
+}
+
+void SymbolTable::exitFunction()
+{
+  frame = frames.back().first;
+  frames.pop_back();
+  exitScope();
+}
+
+void SymbolTable::bind(unsigned id, AllocaInst *A)
+{
+  if (id >= bindings.size())
+    bindings.resize(id + 1, Binding{nullptr, 0});
+  shadowed.emplace_back(id, bindings[id]);
+  bindings[id] = Binding{A, frame};
+}
+
+AllocaInst *SymbolTable::lookup(unsigned id) const
+{
+  return id < bindings.size() && bindings[id].frame == frame ? bindings[id].alloca : nullptr;
+}
+
+// legami visibili nella funzione corrente, nell'ordine degli identificativi dei simboli:
+// sono tutti fra quelli fatti dopo l'ultima barriera, quindi non si scorre l'intera tabella
+std::vector<std::pair<unsigned, AllocaInst *>> SymbolTable::visible() const
+{
+  std::vector<unsigned> ids;
+  for (size_t i = frames.empty() ? 0 : frames.back().second; i < shadowed.size(); i++)
+    ids.push_back(shadowed[i].first);
+  std::sort(ids.begin(), ids.end());
+  ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+
+  std::vector<std::pair<unsigned, AllocaInst *>> result;
+  for (unsigned id : ids)
+    if (AllocaInst *A = lookup(id))
+      result.emplace_back(id, A);
+  return result;
+}
+
+void SymbolTable::clear()
+{
+  bindings.clear();
+  shadowed.clear();
+  scopes.clear();
+  frames.clear();
+  frame = frameCount = 0;
+}
+
+/*  --time-report
+ *  Le fasi sono misurate a parete e possono essere annidate: "codegen" comprende anche "verify"
+ *  e "optimize (function)", che vengono eseguite funzione per funzione durante la generazione.
+ */
+PhaseTimer::PhaseTimer(CompileStats &stats, const char *name) : stats(stats), name(name), trace(name)
+{
+  if (stats.enabled)
+    start = std::chrono::steady_clock::now();
+}
+
+PhaseTimer::~PhaseTimer()
+{
+  if (stats.enabled)
+    stats.addPhase(name, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+}
+
+void CompileStats::addPhase(StringRef name, double seconds)
+{
+  for (auto &P : phases)
+    if (P.first == name)
+    {
+      P.second += seconds;
+      return;
+    }
+  phases.emplace_back(name.str(), seconds);
+}
+
+void CompileStats::merge(const CompileStats &other)
+{
+  for (auto &P : other.phases)
+    addPhase(P.first, P.second);
+  tokens += other.tokens;
+  astNodes += other.astNodes;
+  astBytes += other.astBytes;
+  astAllocations += other.astAllocations;
+  functions += other.functions;
+  irInstructions += other.irInstructions;
+  optimizedInstructions += other.optimizedInstructions;
+  cacheHits += other.cacheHits;
+  cacheMisses += other.cacheMisses;
+}
+
+void CompileStats::printTable(raw_ostream &OS) const
+{
+  auto row = [&OS](StringRef name, const std::string &value)
+  {
+    OS << "  " << left_justify(name, 28) << " " << right_justify(value, 14) << "\n";
+  };
+  OS << "===-------------------------------------------------===\n"
+     << "                  kcomp time report\n"
+     << "===-------------------------------------------------===\n";
+  row("phase", "time (ms)");
+  for (auto &P : phases)
+    row(P.first, formatv("{0:F3}", P.second * 1000).str());
+  OS << "\n";
+  row("counter", "value");
+  row("tokens", std::to_string(tokens));
+  row("AST nodes", std::to_string(astNodes));
+  row("AST arena bytes", std::to_string(astBytes));
+  row("AST heap allocations", std::to_string(astAllocations));
+  row("functions", std::to_string(functions));
+  row("IR instructions", std::to_string(irInstructions));
+  row("IR instructions (final)", std::to_string(optimizedInstructions));
+  row("cache hits", std::to_string(cacheHits));
+  row("cache misses", std::to_string(cacheMisses));
+}
+
+void CompileStats::printJSON(raw_ostream &OS) const
+{
+  json::OStream J(OS, 2);
+  J.object([&]
+           {
+    J.attributeObject("phases_ms", [&]
+                      {
+      for (auto &P : phases)
+        J.attribute(P.first, P.second * 1000); });
+    J.attributeObject("counters", [&]
+                      {
+      J.attribute("tokens", (int64_t)tokens);
+      J.attribute("ast_nodes", (int64_t)astNodes);
+      J.attribute("ast_arena_bytes", (int64_t)astBytes);
+      J.attribute("ast_heap_allocations", (int64_t)astAllocations);
+      J.attribute("functions", (int64_t)functions);
+      J.attribute("ir_instructions", (int64_t)irInstructions);
+      J.attribute("ir_instructions_final", (int64_t)optimizedInstructions);
+      J.attribute("cache_hits", (int64_t)cacheHits);
+      J.attribute("cache_misses", (int64_t)cacheMisses); }); });
+  OS << "\n";
+}
+
+ASTArena::~ASTArena()
+{
+  release();
+}
+
+void ASTArena::release()
+{
+  for (RootAST *node : nodes)
+    node->~RootAST();
+  nodes.clear();
+  allocator.Reset();
+}
+
+size_t ASTArena::getNodeCount() const
+{
+  return nodes.size();
+}
+
+size_t ASTArena::getBytesAllocated() const
+{
+  return allocator.getBytesAllocated();
+}
+
+// allocazioni sullo heap fatte dall'arena: una per blocco (slab), non una per nodo
+size_t ASTArena::getSlabCount() const
+{
+  return allocator.GetNumSlabs();
+}
+
+/*  Chiusura del modulo
+ *  Viene chiamata una sola volta, dopo la generazione del codice di tutti i file: esegue lo stadio
+ *  per-modulo dell'ottimizzatore e poi, in base alla modalità, stampa il modulo per intero,
+ *  lo esegue in-process con il JIT oppure lo scrive su file (oggetto, assembly o bitcode).
+ */
+int driver::finish()
+{
+  if (!deferEmission())
+    return 0;
+
+  if (profile)
+    emitProfileTable();
+  optimizeModule();
+  if (stats.enabled)
+    stats.optimizedInstructions += module->getInstructionCount();
+
+  if (!jitEntry.empty())
+  {
+    double result;
+    if (jit(result))
+      return 1;
+    std::cout << jitEntry << " = " << result << std::endl;
+    return 0;
+  }
+
+  if (emitKind != EMIT_IR)
+    return writeOutput();
+
+  module->print(errs(), nullptr);
+  return 0;
+}
+
+/** Emissione nativa [-o, -S, --emit-bc]
+ *  La TargetMachine in-process sostituisce lo script tobinary (llvm-as, llc, as): il modulo non
+ *  passa più per la sua forma testuale. Il nome del file di uscita, se non indicato con -o,
+ *  si ricava dall'ultimo file sorgente sostituendo l'estensione.
+ *
+ *  Con -mcpu=<cpu> (o -march=<cpu>) si sceglie il processore; -march=native usa CPU e feature
+ *  dell'host, così le estensioni vettoriali disponibili arrivano fino al backend.
+ */
+bool driver::initTarget()
+{
+  if (TM)
+    return true;
+
+  InitializeNative();
+
+  std::string triple = sys::getDefaultTargetTriple();
+  std::string error;
+  const Target *target = TargetRegistry::lookupTarget(triple, error);
+  if (!target)
+  {
+    std::cerr << "target not available: " << error << std::endl;
+    return false;
+  }
+
+  std::string features;
+  if (cpu == "native")
+  {
+    cpu = sys::getHostCPUName().str();
+    StringMap<bool> hostFeatures;
+    if (sys::getHostCPUFeatures(hostFeatures))
+      for (auto &F : hostFeatures)
+        features += (F.second ? "+" : "-") + F.first().str() + ",";
+  }
+
+  CodeGenOpt::Level level = optLevel == 0 ? CodeGenOpt::None : optLevel == 1 ? CodeGenOpt::Less
+                                                           : optLevel == 2   ? CodeGenOpt::Default
+                                                                             : CodeGenOpt::Aggressive;
+  // con fast-math o --fp-contract=fast il backend può fondere mul e add in fma
+  TargetOptions options;
+  if (fastMath || fpContractFast)
+    options.AllowFPOpFusion = FPOpFusion::Fast;
+  TM.reset(target->createTargetMachine(triple, cpu, features, options, Reloc::PIC_, std::nullopt, level));
+  module->setTargetTriple(triple);
+  module->setDataLayout(TM->createDataLayout());
+  return true;
+}
+
+std::string driver::getOutputFile() const
+{
+  if (!outputFile.empty())
+    return outputFile;
+  std::string base = file.substr(0, file.rfind('.'));
+  return base + (emitKind == EMIT_ASSEMBLY ? ".s" : emitKind == EMIT_BITCODE ? ".bc" : ".o");
+}
+
+int driver::writeOutput()
+{
+  PhaseTimer timer(stats, "emit");
+  if (!initTarget())
+    return 1;
+
+  outputFile = getOutputFile();
+
+  std::error_code EC;
+  raw_fd_ostream dest(outputFile, EC, sys::fs::OF_None);
+  if (EC)
+  {
+    std::cerr << "cannot open " << outputFile << ": " << EC.message() << std::endl;
+    return 1;
+  }
+
+  if (emitKind == EMIT_BITCODE)
+  {
+    WriteBitcodeToFile(*module, dest);
+    dest.flush();
+    storeCachedOutput();
+    return 0;
+  }
+
+  legacy::PassManager pass;
+  CodeGenFileType fileType = emitKind == EMIT_ASSEMBLY ? CGFT_AssemblyFile : CGFT_ObjectFile;
+  if (TM->addPassesToEmitFile(pass, dest, nullptr, fileType))
+  {
+    std::cerr << "target cannot emit a file of this type" << std::endl;
+    return 1;
+  }
+  pass.run(*module);
+  dest.flush();
+  storeCachedOutput();
+  return 0;
+}
+
+/** Ottimizzazione [-O1/-O2/-O3]
+ *  L'IR prodotto dai metodi codegen è volutamente "ingenuo": ogni variabile vive in una alloca
+ *  e ogni accesso passa per load/store. L'ottimizzazione è divisa in due stadi, entrambi costruiti
+ *  con il nuovo PassManager di LLVM:
+ *    1. stadio per-funzione: la pipeline di semplificazione (SROA/mem2reg, instcombine, GVN, LICM,
+ *       unroll completo dei cicli, ...) eseguita su ogni funzione appena verificata;
+ *    2. stadio per-modulo: la pipeline di default del livello scelto, che aggiunge inlining,
+ *       loop-unroll, loop-vectorize e SLP-vectorize, eseguita una volta sul modulo completo.
+ *
+ *  Il PassBuilder viene costruito sulla stessa TargetMachine usata per l'emissione, in modo che
+ *  i vettorizzatori conoscano la dimensione reale dei registri della CPU scelta.
+ *
+ *  PGO [--pgo-gen, --pgo-use=file.profdata]: con --pgo-gen la pipeline di modulo instrumenta
+ *  il programma (anche a -O0), che all'uscita scrive un profilo .profraw da unire con
+ *  llvm-profdata merge; con --pgo-use il profilo viene letto all'inizio della pipeline di modulo,
+ *  che aggiunge i pesi dei rami (if, ?:, for) e i conteggi di ingresso delle funzioni e delle chiamate.
+ *  In entrambi i casi lo stadio per-funzione non viene eseguito: instrumentazione e profilo devono
+ *  vedere lo stesso IR, quello prodotto dai metodi codegen.
+ */
+static OptimizationLevel getOptimizationLevel(unsigned level)
+{
+  switch (level)
+  {
+  case 1:
+    return OptimizationLevel::O1;
+  case 2:
+    return OptimizationLevel::O2;
+  default:
+    return OptimizationLevel::O3;
+  }
+}
+
+void driver::initOptimizer()
+{
+  if (PB)
+    return;
+
+  if (!initTarget())
+    std::cerr << "optimizing without target info" << std::endl;
+
+  // con --time-trace anche i singoli passi di ottimizzazione compaiono nella traccia
+  if (timeTraceProfilerEnabled())
+  {
+    SI = std::make_unique<StandardInstrumentations>(*context, false);
+    SI->registerCallbacks(PIC, &FAM);
+  }
+  // PGO: instrumentazione (--pgo-gen) o lettura del profilo raccolto (--pgo-use), nella pipeline di modulo
+  std::optional<PGOOptions> PGOOpt;
+  if (pgoGen)
+    PGOOpt = PGOOptions(pgoGenFile, "", "", PGOOptions::IRInstr);
+  else if (!pgoUse.empty())
+    PGOOpt = PGOOptions(pgoUse, "", "", PGOOptions::IRUse);
+  PB = std::make_unique<PassBuilder>(TM.get(), PipelineTuningOptions(), PGOOpt, &PIC);
+  PB->registerModuleAnalyses(MAM);
+  PB->registerCGSCCAnalyses(CGAM);
+  PB->registerFunctionAnalyses(FAM);
+  PB->registerLoopAnalyses(LAM);
+  PB->crossRegisterProxies(LAM, FAM, CGAM, MAM);
+
+  FPM = PB->buildFunctionSimplificationPipeline(getOptimizationLevel(optLevel), ThinOrFullLTOPhase::None);
+}
+
+void driver::optimizeFunction(Function &F)
+{
+  // con PGO l'instrumentazione e i pesi del profilo vanno applicati all'IR così come è stato generato
+  if (optLevel == 0 || pgoGen || !pgoUse.empty())
+    return;
+  initOptimizer();
+  PhaseTimer timer(stats, "optimize (function)");
+  FPM.run(F, FAM);
+}
+
+void driver::optimizeModule()
+{
+  if (optLevel == 0 && !pgoGen)
+    return;
+  initOptimizer();
+
+  // le analisi memorizzate durante lo stadio per-funzione non valgono più per il modulo completo
+  LAM.clear();
+  FAM.clear();
+  CGAM.clear();
+  MAM.clear();
+
+  PhaseTimer timer(stats, "optimize (module)");
+  // con --lto la vettorizzazione e l'inlining aggressivo sono rimandati al link, dove il programma è completo
+  ModulePassManager MPM = optLevel == 0 ? PB->buildO0DefaultPipeline(OptimizationLevel::O0)
+                          : lto         ? PB->buildLTOPreLinkDefaultPipeline(getOptimizationLevel(optLevel))
+                                        : PB->buildPerModuleDefaultPipeline(getOptimizationLevel(optLevel));
+  MPM.run(*module, MAM);
+}
+
+/** Ottimizzazione dell'intero programma [--link]
+ *  I file bitcode prodotti con --lto vengono fusi, con llvm::Linker, nel modulo (vuoto) del driver.
+ *  Le definizioni non esportate con --export (main lo è sempre) diventano interne: la pipeline LTO
+ *  può quindi espanderle nei chiamanti degli altri file, propagarne le costanti ed eliminarle.
+ *  Senza --export tutte le funzioni restano visibili e si ottiene solo l'inlining tra moduli.
+ *  Il risultato è scritto come oggetto (o assembly, bitcode) da writeOutput.
+ */
+int driver::link(const std::vector<std::string> &inputs)
+{
+  if (inputs.empty())
+  {
+    std::cerr << "no bitcode files to link" << std::endl;
+    return 1;
+  }
+  file = inputs.back();
+
+  {
+    PhaseTimer timer(stats, "link");
+    Linker linker(*module);
+    for (auto &input : inputs)
+    {
+      SMDiagnostic err;
+      std::unique_ptr<Module> M = parseIRFile(input, err, *context);
+      if (!M)
+      {
+        err.print("kcomp", errs());
+        return 1;
+      }
+      if (linker.linkInModule(std::move(M)))
+      {
+        std::cerr << "cannot link " << input << std::endl;
+        return 1;
+      }
+    }
+  }
+
+  if (!exports.empty())
+    internalizeModule(*module, [this](const GlobalValue &GV)
+                      { return GV.getName() == "main" ||
+                               std::find(exports.begin(), exports.end(), GV.getName().str()) != exports.end(); });
+
+  if (verifyModule(*module, &errs()))
+    return 1;
+  if (stats.enabled)
+    stats.irInstructions += module->getInstructionCount();
+
+  if (optLevel > 0)
+  {
+    initOptimizer();
+    PhaseTimer timer(stats, "optimize (lto)");
+    ModulePassManager MPM = PB->buildLTODefaultPipeline(getOptimizationLevel(optLevel), nullptr);
+    MPM.run(*module, MAM);
+  }
+  if (stats.enabled)
+    stats.optimizedInstructions += module->getInstructionCount();
+
+  if (emitKind != EMIT_IR)
+    return writeOutput();
+  module->print(errs(), nullptr);
+  return 0;
+}
+
+/** Cache di compilazione [--cache-dir=<dir>]
+ *  Funziona su due livelli:
+ *    1. file: con -o, -S o --emit-bc la chiave è formata dai nomi e dai testi di tutti i sorgenti
+ *       del modulo; se la voce esiste viene copiata come file di uscita, senza nemmeno fare il parsing;
+ *    2. funzione: ogni "def" è conservata come modulo bitcode che contiene soltanto la sua
+ *       definizione (e le eventuali parfor estratte) e le dichiarazioni dei valori globali che usa,
+ *       dopo lo stadio per-funzione dell'ottimizzatore.
+ *       La chiave è il testo della definizione più il contesto che ne può cambiare il codice:
+ *       prototipi e variabili globali dichiarati prima e i testi delle funzioni espandibili in linea.
+ *       Modificando il corpo di una funzione viene quindi rigenerata soltanto quella; la voce
+ *       ritrovata viene unita al modulo con llvm::Linker.
+ *  Con --profile la cache di funzione non viene usata: i contatori appartengono al modulo.
+ */
+std::string CompileCache::entry(StringRef kind, ArrayRef<StringRef> parts) const
+{
+  MD5 hash;
+  hash.update(fingerprint);
+  hash.update(kind);
+  // la lunghezza di ogni parte evita che testi diversi, concatenati, diano la stessa chiave
+  for (StringRef part : parts)
+  {
+    hash.update(std::to_string(part.size()) + ":");
+    hash.update(part);
+  }
+  MD5::MD5Result result;
+  hash.final(result);
+  return dir + "/" + result.digest().str().str() + "." + kind.str();
+}
+
+bool CompileCache::fetch(const std::string &entry, const std::string &dest) const
+{
+  return sys::fs::exists(entry) && !sys::fs::copy_file(entry, dest);
+}
+
+bool CompileCache::store(const std::string &entry, function_ref<void(raw_ostream &)> write) const
+{
+  int fd;
+  SmallString<128> tmp;
+  if (sys::fs::createUniqueFile(entry + ".%%%%%%.tmp", fd, tmp))
+    return false;
+  {
+    raw_fd_ostream out(fd, true);
+    write(out);
+    if (out.has_error())
+    {
+      out.clear_error();
+      sys::fs::remove(tmp);
+      return false;
+    }
+  }
+  if (sys::fs::rename(tmp, entry))
+  {
+    sys::fs::remove(tmp);
+    return false;
+  }
+  return true;
+}
+
+// impronta delle opzioni che cambiano il codice generato, calcolata una volta per processo
+int driver::initCache()
+{
+  if (!cache.enabled())
+    return 0;
+  if (std::error_code EC = sys::fs::create_directories(cache.dir))
+  {
+    std::cerr << "cannot create " << cache.dir << ": " << EC.message() << std::endl;
+    return 1;
+  }
+
+  std::string fingerprint;
+  raw_string_ostream OS(fingerprint);
+  OS << "kcomp-cache-1 llvm-" LLVM_VERSION_STRING " " << sys::getDefaultTargetTriple()
+     << " cpu=" << (cpu == "native" ? sys::getHostCPUName().str() : cpu)
+     << " O" << optLevel << " fast-math=" << fastMath << " fp-contract=" << fpContractFast
+     << " builtins=" << builtins << " inline=" << inlineThreshold
+     << " lto=" << lto << " profile=" << profile << profileCycles
+     << " pgo-gen=" << pgoGen << pgoGenFile << " pgo-use=" << pgoUse;
+  // con --pgo-use il codice dipende anche dal contenuto del profilo
+  if (!pgoUse.empty())
+    if (auto profileData = MemoryBuffer::getFile(pgoUse))
+    {
+      MD5::MD5Result result;
+      MD5 hash;
+      hash.update((*profileData)->getBuffer());
+      hash.final(result);
+      OS << ":" << result.digest();
+    }
+  cache.fingerprint = OS.str();
+  return 0;
+}
+
+bool driver::loadCachedOutput(const std::vector<std::string> &sources)
+{
+  if (!cache.enabled() || emitKind == EMIT_IR || !jitEntry.empty() || sources.empty())
+    return false;
+
+  std::vector<std::unique_ptr<MemoryBuffer>> buffers;
+  std::vector<StringRef> parts;
+  for (auto &source : sources)
+  {
+    auto buffer = MemoryBuffer::getFile(source);
+    if (!buffer)
+      return false;
+    buffers.push_back(std::move(*buffer));
+    parts.push_back(source);
+    parts.push_back(buffers.back()->getBuffer());
+  }
+
+  std::string kind = "output" + std::to_string(emitKind);
+  file = sources.back();
+  outputEntry = cache.entry(kind, parts);
+  if (!cache.fetch(outputEntry, getOutputFile()))
+  {
+    stats.cacheMisses++;
+    return false;
+  }
+  stats.cacheHits++;
+  outputEntry.clear();
+  return true;
+}
+
+void driver::storeCachedOutput()
+{
+  if (outputEntry.empty())
+    return;
+  auto buffer = MemoryBuffer::getFile(outputFile);
+  if (buffer)
+    cache.store(outputEntry, [&](raw_ostream &OS)
+                { OS << (*buffer)->getBuffer(); });
+  outputEntry.clear();
+}
+
+// testo sorgente compreso fra le due posizioni di l (colonne contate in byte, come nello scanner)
+std::string driver::sourceText(const yy::location &l)
+{
+  if (!cache.enabled() || !inputMap)
+    return "";
+  if (lineStarts.empty())
+  {
+    lineStarts.push_back(0);
+    for (size_t i = 0; i < inputLength - 2; i++)
+      if (inputMap[i] == '\n')
+        lineStarts.push_back(i + 1);
+  }
+  if (l.end.line < 1 || (size_t)l.end.line > lineStarts.size())
+    return "";
+  size_t begin = lineStarts[l.begin.line - 1] + l.begin.column - 1;
+  size_t end = lineStarts[l.end.line - 1] + l.end.column - 1;
+  return end > begin && end <= inputLength - 2 ? std::string(inputMap + begin, end - begin) : "";
+}
+
+void driver::addCacheContext(const std::string &text)
+{
+  if (cache.enabled())
+    cacheContext += text + ";";
+}
+
+std::string driver::functionCacheEntry(StringRef source) const
+{
+  if (!cache.enabled() || profile || source.empty())
+    return "";
+  return cache.entry("function", {cacheContext, source});
+}
+
+Function *driver::loadCachedFunction(const std::string &entry, const Symbol &S)
+{
+  if (entry.empty())
+    return nullptr;
+  if (!sys::fs::exists(entry))
+  {
+    stats.cacheMisses++;
+    return nullptr;
+  }
+  SMDiagnostic err;
+  std::unique_ptr<Module> cached = parseIRFile(entry, err, *context);
+  // una voce illeggibile (o scritta da un'altra versione) viene semplicemente rigenerata
+  if (!cached || Linker::linkModules(*module, std::move(cached)))
+  {
+    stats.cacheMisses++;
+    return nullptr;
+  }
+  Function *F = module->getFunction(S.name);
+  if (!F || F->isDeclaration())
+    return nullptr;
+  stats.cacheHits++;
+  bindFunction(S, F);
+  return F;
+}
+
+// valori globali usati da V, anche attraverso espressioni costanti (ad esempio GEP su un array globale)
+static void collectGlobals(const Value *V, SmallPtrSetImpl<const Constant *> &seen, SetVector<GlobalValue *> &used)
+{
+  if (auto *GV = dyn_cast<GlobalValue>(V))
+    used.insert(const_cast<GlobalValue *>(GV));
+  else if (auto *C = dyn_cast<Constant>(V))
+    if (seen.insert(C).second)
+      for (const Use &U : C->operands())
+        collectGlobals(U.get(), seen, used);
+}
+
+void driver::storeCachedFunction(const std::string &entry, Function *F)
+{
+  if (entry.empty())
+    return;
+
+  // la funzione e le parfor estratte dal suo corpo (interne, raggiunte dalle chiamate al runtime);
+  // ogni altro valore globale usato diventa una dichiarazione: la voce non cresce con il modulo
+  SetVector<Function *> bodies;
+  SetVector<GlobalValue *> used;
+  SmallPtrSet<const Constant *, 16> seen;
+  bodies.insert(F);
+  for (size_t i = 0; i < bodies.size(); i++)
+  {
+    for (const Instruction &I : instructions(*bodies[i]))
+      for (const Use &U : I.operands())
+        collectGlobals(U.get(), seen, used);
+    for (GlobalValue *GV : used)
+      if (auto *G = dyn_cast<Function>(GV))
+        if (G->hasLocalLinkage() && !G->isDeclaration())
+          bodies.insert(G);
+  }
+
+  Module M(module->getModuleIdentifier(), *context);
+  M.setTargetTriple(module->getTargetTriple());
+  M.setDataLayout(module->getDataLayout());
+  ValueToValueMapTy VMap;
+  for (GlobalValue *GV : used)
+  {
+    if (auto *G = dyn_cast<Function>(GV))
+    {
+      if (bodies.count(G))
+        continue;
+      Function *D = Function::Create(G->getFunctionType(), GlobalValue::ExternalLinkage, G->getName(), M);
+      D->copyAttributesFrom(G);
+      VMap[G] = D;
+    }
+    else if (auto *G = dyn_cast<GlobalVariable>(GV))
+      VMap[G] = new GlobalVariable(M, G->getValueType(), G->isConstant(), GlobalValue::ExternalLinkage,
+                                   nullptr, G->getName(), nullptr, G->getThreadLocalMode(),
+                                   G->getAddressSpace());
+  }
+  for (Function *B : bodies)
+  {
+    Function *C = Function::Create(B->getFunctionType(), B->getLinkage(), B->getName(), M);
+    VMap[B] = C;
+    auto arg = C->arg_begin();
+    for (const Argument &A : B->args())
+    {
+      arg->setName(A.getName());
+      VMap[&A] = &*arg++;
+    }
+  }
+  for (Function *B : bodies)
+  {
+    SmallVector<ReturnInst *, 4> returns;
+    CloneFunctionInto(cast<Function>(VMap[B]), B, VMap, CloneFunctionChangeType::DifferentModule, returns);
+  }
+
+  cache.store(entry, [&](raw_ostream &OS)
+              { WriteBitcodeToFile(M, OS); });
+}
+
+/*  Emissione dell'IR
+ *  Senza ottimizzazione ogni funzione, prototipo o variabile globale viene stampata su stderr
+ *  non appena generata; altrimenti la stampa è rimandata a driver::finish.
+ */
+bool driver::deferEmission() const
+{
+  return optLevel > 0 || !jitEntry.empty() || emitKind != EMIT_IR || profile || pgoGen;
+}
+
+void driver::emit(GlobalValue *V)
+{
+  if (deferEmission())
+    return;
+  V->print(errs());
+  fprintf(stderr, "\n");
+}
+
+/** Esecuzione in-process [--jit]
+ *  Il modulo viene consegnato a un'istanza LLJIT di ORC, evitando il passaggio kcomp -> tobinary -> clang++.
+ *  I prototipi extern vengono risolti, nell'ordine, tra:
+ *    1. le funzioni definite nel modulo stesso;
+ *    2. i simboli registrati con registerSymbol (callback dell'host);
+ *    3. i simboli del processo kcomp, quindi anche la libm (floor, sqrt, ...).
+ *
+ *  Per chiamare la funzione di ingresso con un numero arbitrario di argomenti double si genera
+ *  un wrapper "__kcomp_entry(double *args)" che carica gli argomenti dall'array e li passa alla funzione.
+ *  Il modulo e il contesto passano di proprietà al JIT: dopo la chiamata non sono più utilizzabili.
+ */
+void driver::registerSymbol(const std::string &name, void *addr)
+{
+  hostSymbols[name] = addr;
+}
+
+static Function *CreateEntryWrapper(Function *entry)
+{
+  LLVMContext &ctx = entry->getContext();
+  Type *doubleTy = Type::getDoubleTy(ctx);
+  FunctionType *FT = FunctionType::get(doubleTy, {PointerType::getUnqual(doubleTy)}, false);
+  Function *wrapper = Function::Create(FT, Function::ExternalLinkage, "__kcomp_entry", entry->getParent());
+
+  IRBuilder<> TmpB(BasicBlock::Create(ctx, "entry", wrapper));
+  Value *argv = wrapper->getArg(0);
+  std::vector<Value *> ArgsV;
+  for (unsigned i = 0; i < entry->arg_size(); i++)
+  {
+    Value *ptr = TmpB.CreateConstGEP1_32(doubleTy, argv, i);
+    ArgsV.push_back(TmpB.CreateLoad(doubleTy, ptr));
+  }
+  TmpB.CreateRet(TmpB.CreateCall(entry, ArgsV));
+  return wrapper;
+}
+
+int driver::jit(double &result)
+{
+  PhaseTimer timer(stats, "jit");
+  Function *entry = module->getFunction(jitEntry);
+  if (!entry || entry->isDeclaration())
+  {
+    std::cerr << "undefined entry function: " << jitEntry << std::endl;
+    return 1;
+  }
+  if (entry->arg_size() != jitArgs.size())
+  {
+    std::cerr << "incorrect number of arguments for " << jitEntry << std::endl;
+    return 1;
+  }
+  CreateEntryWrapper(entry);
+
+  InitializeNative();
+
+  auto J = orc::LLJITBuilder().create();
+  if (!J)
+  {
+    errs() << toString(J.takeError()) << "\n";
+    return 1;
+  }
+
+  orc::JITDylib &JD = (*J)->getMainJITDylib();
+  orc::SymbolMap symbols;
+  for (auto &S : hostSymbols)
+    symbols[(*J)->mangleAndIntern(S.first)] = JITEvaluatedSymbol(pointerToJITTargetAddress(S.second), JITSymbolFlags::Exported);
+  if (Error err = JD.define(orc::absoluteSymbols(std::move(symbols))))
+  {
+    errs() << toString(std::move(err)) << "\n";
+    return 1;
+  }
+
+  auto processSymbols = orc::DynamicLibrarySearchGenerator::GetForCurrentProcess((*J)->getDataLayout().getGlobalPrefix());
+  if (!processSymbols)
+  {
+    errs() << toString(processSymbols.takeError()) << "\n";
+    return 1;
+  }
+  JD.addGenerator(std::move(*processSymbols));
+
+  builder.reset();
+  orc::ThreadSafeModule TSM(std::move(module), std::move(context));
+  if (Error err = (*J)->addIRModule(std::move(TSM)))
+  {
+    errs() << toString(std::move(err)) << "\n";
+    return 1;
+  }
+
+  auto sym = (*J)->lookup("__kcomp_entry");
+  if (!sym)
+  {
+    errs() << toString(sym.takeError()) << "\n";
+    return 1;
+  }
+
+  // costruttori e distruttori globali del modulo (ad esempio la stampa del profilo di --profile)
+  if (Error err = (*J)->initialize(JD))
+  {
+    errs() << toString(std::move(err)) << "\n";
+    return 1;
+  }
+  auto *fn = sym->toPtr<double (*)(double *)>();
+  result = fn(jitArgs.data());
+  if (Error err = (*J)->deinitialize(JD))
+  {
+    errs() << toString(std::move(err)) << "\n";
+    return 1;
+  }
+  return 0;
+}
+
+/** Profilo di esecuzione [--profile, --profile=cycles]
+ *  Con --profile il codice generato conta le chiamate di ogni funzione, le iterazioni di ogni for,
+ *  le esecuzioni di ogni parfor e i rami presi da ogni if; con --profile=cycles ogni funzione
+ *  accumula anche i cicli (llvm.readcyclecounter, rdtsc su x86) trascorsi fra ingresso e ret,
+ *  comprese le funzioni chiamate.
+ *
+ *  Ogni punto contato ha un contatore globale a 64 bit, incrementato con un atomicrmw add monotonic:
+ *  i corpi di parfor vengono eseguiti in parallelo dai thread del runtime.
+ *  Alla fine del modulo (finish) si scrive la tabella dei punti, con file, tipo, funzione e riga
+ *  del sorgente, e un distruttore globale che la passa a __kcomp_profile_dump (runtime.cpp):
+ *  il report viene così stampato all'uscita del programma, o al termine dell'esecuzione con --jit.
+ */
+profileSite driver::addProfileSite(const char *kind, StringRef name, int line, bool cycles)
+{
+  Type *i64 = Type::getInt64Ty(*context);
+  profileSite site{file, kind, name.str(), line, nullptr, nullptr};
+  site.count = new GlobalVariable(*module, i64, false, GlobalValue::InternalLinkage, ConstantInt::get(i64, 0), "__kcomp_prof.count");
+  if (cycles && profileCycles)
+    site.cycles = new GlobalVariable(*module, i64, false, GlobalValue::InternalLinkage, ConstantInt::get(i64, 0), "__kcomp_prof.cycles");
+  profileSites.push_back(site);
+  return site;
+}
+
+void driver::profileIncrement(GlobalVariable *counter, Value *amount)
 {
-  file = f;
-  location.initialize(&file);
-  scan_begin();
-  yy::parser parser(*this);
-  parser.set_debug_level(trace_parsing);
-  int res = parser.parse();
-  scan_end();
-  return res;
+  if (!amount)
+    amount = ConstantInt::get(Type::getInt64Ty(*context), 1);
+  builder->CreateAtomicRMW(AtomicRMWInst::Add, counter, amount, MaybeAlign(8), AtomicOrdering::Monotonic);
 }
 
-void driver::codegen()
+void driver::emitProfileTable()
 {
-  // inizia il processo di generazione del codice chiamando il metodo codegen sul nodo radice dell'AST
-  root->codegen(*this);
-};
+  if (profileSites.empty())
+    return;
+
+  LLVMContext &ctx = *context;
+  PointerType *ptrTy = PointerType::getUnqual(ctx);
+  Type *i64 = Type::getInt64Ty(ctx);
+  StructType *siteTy = StructType::get(ctx, {ptrTy, ptrTy, ptrTy, i64, ptrTy, ptrTy});
+  auto str = [&](StringRef s) -> Constant *
+  {
+    Constant *data = ConstantDataArray::getString(ctx, s);
+    GlobalVariable *GV = new GlobalVariable(*module, data->getType(), true, GlobalValue::PrivateLinkage, data, "__kcomp_prof.str");
+    GV->setUnnamedAddr(GlobalValue::UnnamedAddr::Global);
+    return GV;
+  };
+
+  std::vector<Constant *> entries;
+  for (auto &S : profileSites)
+    entries.push_back(ConstantStruct::get(siteTy, {str(S.file), str(S.kind), str(S.name), ConstantInt::get(i64, S.line), S.count,
+                                                   S.cycles ? (Constant *)S.cycles : ConstantPointerNull::get(ptrTy)}));
+  ArrayType *tableTy = ArrayType::get(siteTy, entries.size());
+  GlobalVariable *table = new GlobalVariable(*module, tableTy, true, GlobalValue::PrivateLinkage,
+                                             ConstantArray::get(tableTy, entries), "__kcomp_prof.sites");
+
+  FunctionCallee dump = module->getOrInsertFunction("__kcomp_profile_dump", Type::getVoidTy(ctx), ptrTy, i64);
+  Function *fini = Function::Create(FunctionType::get(Type::getVoidTy(ctx), false), GlobalValue::InternalLinkage, "__kcomp_profile_fini", *module);
+  IRBuilder<> B(BasicBlock::Create(ctx, "entry", fini));
+  B.CreateCall(dump, {table, ConstantInt::get(i64, entries.size())});
+  B.CreateRetVoid();
+  appendToGlobalDtors(*module, fini, 0);
+  profileSites.clear();
+}
 
 /************************* Sequence tree **************************/
-SeqAST::SeqAST(RootAST *first, RootAST *continuation) : first(first), continuation(continuation) {};
+SeqAST::SeqAST() {};
+
+// La classe SeqAST rappresenta la sequenza delle definizioni top-level del programma.
+// Le definizioni sono memorizzate in un vettore contiguo, riempito dalla regola left-recursive
+// "program: program top ;": il codegen le visita in ordine con un semplice ciclo, quindi
+// anche un modulo con decine di migliaia di definizioni non consuma stack nativo.
+// Le definizioni vuote (";" isolato) non vengono memorizzate.
 
-// La classe SeqAST rappresenta una sequenza di istruzioni nell'AST
-// Il metodo codegen per SeqAST chiama ricorsivamente codegen su ciascun nodo figlio (first e continuation)
+void SeqAST::append(RootAST *item)
+{
+  if (item != nullptr)
+    items.push_back(item);
+};
 
 Value *SeqAST::codegen(driver &drv)
 {
-  if (first != nullptr)
-  {
-    Value *f = first->codegen(drv);
-  }
-  else
-  {
-    if (continuation == nullptr)
-      return nullptr;
-  }
-  Value *c = continuation->codegen(drv);
+  for (RootAST *item : items)
+    item->codegen(drv);
   return nullptr;
 };
 
@@ -94,36 +1140,68 @@ lexval NumberExprAST::getLexVal() const
 
 Value *NumberExprAST::codegen(driver &drv)
 {
-  return ConstantFP::get(*context, APFloat(Val));
+  return ConstantFP::get(*drv.context, APFloat(Val));
 };
 
 /** Variable Expression Tree
  *  costruisce la classe VariableExprAST con il nome della variabile (Name)
  *  e un puntatore a un'espressione (Exp).
- *  La variabile Exp viene essere utilizzata per rappresentare un'inizializzazione o un'espressione associata alla variabile.
+ *  La variabile Exp rappresenta l'indice, quando la variabile è un array (id[exp]).
  *
- *  Si cerca dapprima una variabile globale già definita, e se non si trova si crea un nuovo nodo.
+ *  Si cerca dapprima una variabile locale, poi una variabile globale già definita.
  */
-VariableExprAST::VariableExprAST(const std::string &Name, ExprAST *Exp) : Name(Name), Exp(Exp) {};
+VariableExprAST::VariableExprAST(Symbol Name, ExprAST *Exp) : Name(Name), Exp(Exp) {};
 
 lexval VariableExprAST::getLexVal() const
 {
-  lexval lval = Name;
+  lexval lval = Name.name.str();
   return lval;
 };
 
-Value *VariableExprAST::codegen(driver &drv)
+/*  Indirizzo di una variabile
+ *  Si cerca prima tra le variabili locali (symbol table) e poi tra le globali. Per gli array,
+ *  l'indice (un double) viene convertito in intero e usato in una GEP sull'ArrayType:
+ *  la stessa utility serve sia alla lettura (VariableExprAST) sia alla scrittura (AssignmentExprAST).
+ */
+static Value *CreateVariableAddress(driver &drv, const Symbol &Name, ExprAST *Exp)
 {
-  AllocaInst *A = drv.NamedValues[Name];
-  if (!A)
+  Value *ptr;
+  Type *type;
+  if (AllocaInst *A = drv.NamedValues.lookup(Name.id))
   {
-    GlobalVariable *globVar = module->getNamedGlobal(Name);
-    if (!globVar)
-      return LogErrorV("undefined variable: " + Name);
+    ptr = A;
+    type = A->getAllocatedType();
+  }
+  else if (GlobalVariable *globVar = drv.lookupGlobal(Name))
+  {
+    ptr = globVar;
+    type = globVar->getValueType();
+  }
+  else
+    return LogErrorV("undefined variable: " + Name.name.str());
 
-    return builder->CreateLoad(globVar->getValueType(), globVar, Name.c_str());
+  if (!Exp)
+  {
+    if (type->isArrayTy())
+      return LogErrorV("array used without index: " + Name.name.str());
+    return ptr;
   }
-  return builder->CreateLoad(A->getAllocatedType(), A, Name.c_str());
+
+  if (!type->isArrayTy())
+    return LogErrorV("indexed variable is not an array: " + Name.name.str());
+  Value *index = Exp->codegen(drv);
+  if (!index)
+    return nullptr;
+  index = drv.builder->CreateFPToSI(index, Type::getInt64Ty(*drv.context), "idx");
+  return drv.builder->CreateInBoundsGEP(type, ptr, {drv.builder->getInt64(0), index}, Name.name);
+}
+
+Value *VariableExprAST::codegen(driver &drv)
+{
+  Value *ptr = CreateVariableAddress(drv, Name, Exp);
+  if (!ptr)
+    return nullptr;
+  return drv.builder->CreateLoad(Type::getDoubleTy(*drv.context), ptr, Name.name);
 }
 
 /** Binary Expression Tree
@@ -133,17 +1211,82 @@ Value *VariableExprAST::codegen(driver &drv)
  *  Tutti gli operatori richiedono l'analisi di LHS e di un RHS; almeno tranne l'operatore unario NOT.
  *  Per l'operatore unario NOT si valuta soltanto il RHS; si costruisce la rappresentazione intermedia del RHS,
  *  e quando non fallita si procede a creare la ramificazione dell'albero sintattico.
+ *
+ *  and/or vengono valutati in cortocircuito: il RHS sta in un blocco proprio, eseguito solo quando
+ *  il LHS non basta a decidere il risultato, e i due valori si uniscono in un phi.
+ *  likely(c)/unlikely(c) (operatori 'l' e 'u') non cambiano il valore di c: sono letti con getBranchHint
+ *  da if, espressioni condizionali e for, che li traducono in metadati branch_weights sul salto condizionato.
  */
 BinaryExprAST::BinaryExprAST(char Op, ExprAST *LHS, ExprAST *RHS) : Op(Op), LHS(LHS), RHS(RHS) {};
 
+int BinaryExprAST::getBranchHint() const
+{
+  if (Op == 'l')
+    return 1;
+  if (Op == 'u')
+    return -1;
+  return 0;
+};
+
+// salto condizionato con i pesi suggeriti da likely/unlikely sulla condizione (stessi pesi di __builtin_expect)
+static BranchInst *CreateHintedCondBr(driver &drv, ExprAST *cond, Value *CondV, BasicBlock *TrueBB, BasicBlock *FalseBB)
+{
+  BranchInst *br = drv.builder->CreateCondBr(CondV, TrueBB, FalseBB);
+  int hint = cond->getBranchHint();
+  if (hint != 0)
+  {
+    MDBuilder MDB(*drv.context);
+    br->setMetadata(LLVMContext::MD_prof, hint > 0 ? MDB.createBranchWeights(2000, 1) : MDB.createBranchWeights(1, 2000));
+  }
+  return br;
+}
+
 Value *BinaryExprAST::codegen(driver &drv)
 {
+  if (Op == '-' && !LHS)
+  {
+    Value *R = RHS->codegen(drv);
+    if (!R)
+      return nullptr;
+    return drv.builder->CreateFNeg(R, "negres");
+  }
   if (Op == 'n')
   {
     Value *R = RHS->codegen(drv);
     if (!R)
       return nullptr;
-    return builder->CreateNot(R, "notres");
+    return drv.builder->CreateNot(R, "notres");
+  }
+  if (Op == 'l' || Op == 'u')
+    return RHS->codegen(drv);
+  if (Op == 'a' || Op == 'o')
+  {
+    Value *L = LHS->codegen(drv);
+    if (!L)
+      return nullptr;
+    Function *fun = drv.builder->GetInsertBlock()->getParent();
+    BasicBlock *LHSBB = drv.builder->GetInsertBlock();
+    BasicBlock *RHSBB = BasicBlock::Create(*drv.context, Op == 'a' ? "and.rhs" : "or.rhs", fun);
+    BasicBlock *MergeBB = BasicBlock::Create(*drv.context, Op == 'a' ? "and.end" : "or.end");
+    // and: LHS falso decide il risultato; or: LHS vero decide il risultato
+    if (Op == 'a')
+      CreateHintedCondBr(drv, LHS, L, RHSBB, MergeBB);
+    else
+      CreateHintedCondBr(drv, LHS, L, MergeBB, RHSBB);
+
+    drv.builder->SetInsertPoint(RHSBB);
+    Value *R = RHS->codegen(drv);
+    if (!R)
+      return nullptr;
+    RHSBB = drv.builder->GetInsertBlock();
+    drv.builder->CreateBr(MergeBB);
+
+    fun->insert(fun->end(), MergeBB);
+    drv.builder->SetInsertPoint(MergeBB);
+    PHINode *P = drv.builder->CreatePHI(Type::getInt1Ty(*drv.context), 2, Op == 'a' ? "andres" : "orres");
+    P->addIncoming(drv.builder->getInt1(Op == 'o'), LHSBB);
+    P->addIncoming(R, RHSBB);
+    return P;
   }
   Value *L = LHS->codegen(drv);
   Value *R = RHS->codegen(drv);
@@ -152,23 +1295,19 @@ Value *BinaryExprAST::codegen(driver &drv)
   switch (Op)
   {
   case '+':
-    return builder->CreateFAdd(L, R, "addres");
+    return drv.builder->CreateFAdd(L, R, "addres");
   case '-':
-    return builder->CreateFSub(L, R, "subres");
+    return drv.builder->CreateFSub(L, R, "subres");
   case '*':
-    return builder->CreateFMul(L, R, "mulres");
+    return drv.builder->CreateFMul(L, R, "mulres");
   case '/':
-    return builder->CreateFDiv(L, R, "addres");
+    return drv.builder->CreateFDiv(L, R, "addres");
   case '<':
-    return builder->CreateFCmpULT(L, R, "lttest");
+    return drv.builder->CreateFCmpULT(L, R, "lttest");
   case '>':
-    return builder->CreateFCmpUGT(L, R, "gttest");
+    return drv.builder->CreateFCmpUGT(L, R, "gttest");
   case '=':
-    return builder->CreateFCmpUEQ(L, R, "eqtest");
-  case 'a':
-    return builder->CreateLogicalAnd(L, R, "andres");
-  case 'o':
-    return builder->CreateLogicalOr(L, R, "orres");
+    return drv.builder->CreateFCmpUEQ(L, R, "eqtest");
   default:
     std::cout << Op << std::endl;
     return LogErrorV("binary operator not supported");
@@ -188,18 +1327,72 @@ Value *BinaryExprAST::codegen(driver &drv)
  *
  *  Una volta verificate i "requisiti" della CC, si avvia la costruzione dei nodi di AST dei nodi argomenti,
  *  memorizzati in un vector.
+ *
+ *  Le funzioni matematiche della libm dichiarate con extern (sqrt, floor, fabs, fma, fmin, ...)
+ *  vengono riconosciute come builtin e chiamate tramite il corrispondente intrinseco di LLVM
+ *  (llvm.sqrt, llvm.floor, ...), che il backend traduce spesso in una sola istruzione e che
+ *  il vettorizzatore sa trattare. Vale solo per le dichiarazioni senza corpo: una funzione
+ *  definita nel programma con lo stesso nome resta una chiamata normale. -fno-builtin disattiva il riconoscimento.
+ *
+ *  Le chiamate in posizione di coda (vedi markTailCalls) vengono marcate tail: gli argomenti sono
+ *  solo double, quindi il chiamato non può accedere alle alloca del chiamante. Una chiamata in coda
+ *  alla funzione stessa diventa invece un salto: i nuovi argomenti vengono scritti nelle alloca
+ *  dei parametri e si torna al blocco tailrecurse, all'inizio del corpo. Il codice che segue il salto
+ *  finisce in un blocco irraggiungibile, e il valore della chiamata è poison.
  */
-CallExprAST::CallExprAST(std::string Callee, std::vector<ExprAST *> Args) : Callee(Callee), Args(std::move(Args)) {};
+CallExprAST::CallExprAST(Symbol Callee, std::vector<ExprAST *> Args) : Callee(Callee), Args(std::move(Args)), tail(false) {};
+
+static Intrinsic::ID getBuiltin(StringRef name, size_t argc)
+{
+  Intrinsic::ID id = StringSwitch<Intrinsic::ID>(name)
+                         .Case("sqrt", Intrinsic::sqrt)
+                         .Case("floor", Intrinsic::floor)
+                         .Case("ceil", Intrinsic::ceil)
+                         .Case("trunc", Intrinsic::trunc)
+                         .Case("round", Intrinsic::round)
+                         .Case("rint", Intrinsic::rint)
+                         .Case("nearbyint", Intrinsic::nearbyint)
+                         .Case("fabs", Intrinsic::fabs)
+                         .Case("sin", Intrinsic::sin)
+                         .Case("cos", Intrinsic::cos)
+                         .Case("exp", Intrinsic::exp)
+                         .Case("exp2", Intrinsic::exp2)
+                         .Case("log", Intrinsic::log)
+                         .Case("log2", Intrinsic::log2)
+                         .Case("log10", Intrinsic::log10)
+                         .Case("pow", Intrinsic::pow)
+                         .Case("copysign", Intrinsic::copysign)
+                         .Case("fmin", Intrinsic::minnum)
+                         .Case("fmax", Intrinsic::maxnum)
+                         .Case("fma", Intrinsic::fma)
+                         .Default(Intrinsic::not_intrinsic);
+  size_t arity = 1;
+  switch (id)
+  {
+  case Intrinsic::fma:
+    arity = 3;
+    break;
+  case Intrinsic::pow:
+  case Intrinsic::copysign:
+  case Intrinsic::minnum:
+  case Intrinsic::maxnum:
+    arity = 2;
+    break;
+  default:
+    break;
+  }
+  return argc == arity ? id : Intrinsic::not_intrinsic;
+}
 
 lexval CallExprAST::getLexVal() const
 {
-  lexval lval = Callee;
+  lexval lval = Callee.name.str();
   return lval;
 };
 
 Value *CallExprAST::codegen(driver &drv)
 {
-  Function *CalleeF = module->getFunction(Callee);
+  Function *CalleeF = drv.lookupFunction(Callee);
   if (!CalleeF)
     return LogErrorV("undefined function");
 
@@ -213,7 +1406,29 @@ Value *CallExprAST::codegen(driver &drv)
     if (!ArgsV.back())
       return nullptr;
   }
-  return builder->CreateCall(CalleeF, ArgsV, "calltmp");
+  if (FunctionAST *inlined = drv.lookupInline(Callee))
+    if (Value *V = inlined->codegenInline(drv, ArgsV))
+      return V;
+  if (tail && drv.tailRecurse && CalleeF == drv.tailRecurse->getParent())
+  {
+    for (unsigned i = 0; i < ArgsV.size(); i++)
+      drv.builder->CreateStore(ArgsV[i], drv.tailArgs[i]);
+    // il salto esce da tutti i blocchi aperti: la prossima iterazione riapre la vita dei loro array
+    drv.endArrayLifetimes(0);
+    drv.builder->CreateBr(drv.tailRecurse);
+    drv.builder->SetInsertPoint(BasicBlock::Create(*drv.context, "aftertail", CalleeF));
+    return PoisonValue::get(Type::getDoubleTy(*drv.context));
+  }
+  if (drv.builtins && CalleeF->isDeclaration())
+  {
+    Intrinsic::ID id = getBuiltin(CalleeF->getName(), ArgsV.size());
+    if (id != Intrinsic::not_intrinsic)
+      return drv.builder->CreateIntrinsic(id, {Type::getDoubleTy(*drv.context)}, ArgsV, nullptr, "calltmp");
+  }
+  CallInst *call = drv.builder->CreateCall(CalleeF, ArgsV, "calltmp");
+  if (tail)
+    call->setTailCall();
+  return call;
 }
 
 /** IF BLOCK for expression
@@ -256,33 +1471,33 @@ Value *IfExprAST::codegen(driver &drv)
   if (!CondV)
     return nullptr;
 
-  Function *fun = builder->GetInsertBlock()->getParent();
-  BasicBlock *TrueBB = BasicBlock::Create(*context, "trueblock", fun);
-  BasicBlock *FalseBB = BasicBlock::Create(*context, "falseblock");
-  BasicBlock *MergeBB = BasicBlock::Create(*context, "mergeblock");
-  builder->CreateCondBr(CondV, TrueBB, FalseBB);
+  Function *fun = drv.builder->GetInsertBlock()->getParent();
+  BasicBlock *TrueBB = BasicBlock::Create(*drv.context, "trueblock", fun);
+  BasicBlock *FalseBB = BasicBlock::Create(*drv.context, "falseblock");
+  BasicBlock *MergeBB = BasicBlock::Create(*drv.context, "mergeblock");
+  CreateHintedCondBr(drv, cond, CondV, TrueBB, FalseBB);
 
   //* FASE 1 - blocco vero
-  builder->SetInsertPoint(TrueBB);
+  drv.builder->SetInsertPoint(TrueBB);
   Value *trueV = trueexp->codegen(drv);
   if (!trueV)
     return nullptr;
-  TrueBB = builder->GetInsertBlock();
-  builder->CreateBr(MergeBB);
+  TrueBB = drv.builder->GetInsertBlock();
+  drv.builder->CreateBr(MergeBB);
   fun->insert(fun->end(), FalseBB);
 
   //* FASE 2 - blocco falso
-  builder->SetInsertPoint(FalseBB);
+  drv.builder->SetInsertPoint(FalseBB);
   Value *falseV = falseexp->codegen(drv);
   if (!falseV)
     return nullptr;
-  FalseBB = builder->GetInsertBlock();
-  builder->CreateBr(MergeBB);
+  FalseBB = drv.builder->GetInsertBlock();
+  drv.builder->CreateBr(MergeBB);
   fun->insert(fun->end(), MergeBB);
 
   //* FASE 3 - convergenza
-  builder->SetInsertPoint(MergeBB);
-  PHINode *P = builder->CreatePHI(Type::getDoubleTy(*context), 2);
+  drv.builder->SetInsertPoint(MergeBB);
+  PHINode *P = drv.builder->CreatePHI(Type::getDoubleTy(*drv.context), 2);
   P->addIncoming(trueV, TrueBB);
   P->addIncoming(falseV, FalseBB);
 
@@ -297,28 +1512,48 @@ Value *IfExprAST::codegen(driver &drv)
  *  Il codice viene attivato nel riconoscimento di un blocco di codice
  *  e semplicemente alloca i nuovi statement.
  *
- *  All'inizio si crea un vettore temporaneo tmp per salvare lo stato corrente della symbol table:
+ *  All'inizio si apre un nuovo scope nella symbol table:
  *  necessario perché le dichiarazioni di variabili all'interno del blocco potrebbero mascherare variabili con
  *  lo stesso nome dichiarate all'esterno del blocco.
  *
- *  Una volta memorizzata la simbol table si cicla sulle definizioni presenti nel blocco, e si genera il nuovo codice
+ *  Aperto lo scope si cicla sulle definizioni presenti nel blocco, e si genera il nuovo codice
  *  Si genera prima il codice per le definizioni, poi il codice per gli staments veri e propri.
  *
- *  Risalta l'utilizzo della simbol table -la tabella associativa, che viene temporaneamente svuotata e modificata.
+ *  Alla chiusura del blocco lo scope viene chiuso, e i binding mascherati tornano visibili.
  */
 BlockAST::BlockAST(std::vector<InitAST *> Def, std::vector<StmtAST *> Stmts) : Def(std::move(Def)), Stmts(std::move(Stmts)) {};
 BlockAST::BlockAST(std::vector<StmtAST *> Stmts) : Stmts(std::move(Stmts)) {};
 
+BlockScope::BlockScope(driver &drv) : drv(drv), arrays(drv.liveArrays.size())
+{
+  drv.NamedValues.enterScope();
+}
+
+BlockScope::~BlockScope()
+{
+  drv.liveArrays.resize(arrays);
+  drv.NamedValues.exitScope();
+}
+
+// fine della vita degli array locali ancora aperti, dal from-esimo in poi: all'uscita da un blocco
+// e, per tutti, prima del salto a tailrecurse di una chiamata ricorsiva in coda
+void driver::endArrayLifetimes(size_t from)
+{
+  for (size_t i = from; i < liveArrays.size(); i++)
+    builder->CreateLifetimeEnd(liveArrays[i], builder->getInt64(module->getDataLayout().getTypeAllocSize(liveArrays[i]->getAllocatedType())));
+}
+
 Value *BlockAST::codegen(driver &drv)
 {
-  std::vector<AllocaInst *> tmp;
+  BlockScope scope(drv);
   for (int i = 0; i < Def.size(); i++)
   {
     AllocaInst *boundval = (AllocaInst *)Def[i]->codegen(drv);
     if (!boundval)
       return nullptr;
-    tmp.push_back(drv.NamedValues[Def[i]->getName()]);
-    drv.NamedValues[Def[i]->getName()] = boundval;
+    if (boundval->getAllocatedType()->isArrayTy())
+      drv.liveArrays.push_back(boundval);
+    drv.NamedValues.bind(Def[i]->getName().id, boundval);
   }
   Value *blockvalue;
   for (int i = 0; i < Stmts.size(); i++)
@@ -327,12 +1562,11 @@ Value *BlockAST::codegen(driver &drv)
     if (!blockvalue)
       return nullptr;
   }
-  for (int i = 0; i < Def.size(); i++)
-    drv.NamedValues[Def[i]->getName()] = tmp[i];
+  drv.endArrayLifetimes(scope.firstArray());
   return blockvalue;
 };
 
-std::string &InitAST::getName() { return Name; };
+Symbol &InitAST::getName() { return Name; };
 initType InitAST::getType() { return INIT; };
 
 /** VarBindingsAST
@@ -346,24 +1580,42 @@ initType InitAST::getType() { return INIT; };
  *  mediante la direttiva < Function *fun = builder->GetInsertBlock()->getParent(); >
  *
  *  la classe, in caso il registor del valore non sia esplitato, gli assegna zero.
+ *
+ *  con "var id[number]" si dichiara un array locale di double. Come per gli scalari l'alloca
+ *  è scritta nell'entry block della funzione, quindi un array dichiarato nel corpo di un for
+ *  non fa crescere lo stack a ogni iterazione. Nel punto della dichiarazione l'array viene
+ *  azzerato e marcato con llvm.lifetime.start; BlockAST chiude la sua vita con llvm.lifetime.end
+ *  all'uscita dal blocco, così LLVM può riusare lo stesso slot per array di blocchi fratelli.
+ *  Un salto a tailrecurse (ricorsione in coda) chiude la vita di tutti gli array aperti.
+ *  Nell'inizializzazione di un for gli array non sono ammessi.
  */
-VarBindingsAST::VarBindingsAST(std::string Name, ExprAST *Val) : Name(Name), Val(Val) {};
-std::string &VarBindingsAST::getName() { return Name; };
+VarBindingsAST::VarBindingsAST(Symbol Name, ExprAST *Val, double Size) : Name(Name), Val(Val), Size(Size) {};
+Symbol &VarBindingsAST::getName() { return Name; };
 initType VarBindingsAST::getType() { return BINDING; };
 
 AllocaInst *VarBindingsAST::codegen(driver &drv)
 {
-  Function *fun = builder->GetInsertBlock()->getParent();
+  Function *fun = drv.builder->GetInsertBlock()->getParent();
+  if (Size > 0)
+  {
+    uint64_t bytes = (uint64_t)Size * sizeof(double);
+    ArrayType *AT = ArrayType::get(Type::getDoubleTy(*drv.context), (uint64_t)Size);
+    AllocaInst *Alloca = CreateEntryBlockAlloca(fun, Name.name, AT);
+    Alloca->setAlignment(Align(32));
+    drv.builder->CreateLifetimeStart(Alloca, drv.builder->getInt64(bytes));
+    drv.builder->CreateMemSet(Alloca, drv.builder->getInt8(0), bytes, Alloca->getAlign());
+    return Alloca;
+  }
+
   Value *boundval;
   if (Val)
     boundval = Val->codegen(drv);
   else
-  {
-    NumberExprAST *defaultVal = new NumberExprAST(0.0);
-    boundval = defaultVal->codegen(drv);
-  }
-  AllocaInst *Alloca = CreateEntryBlockAlloca(fun, Name);
-  builder->CreateStore(boundval, Alloca);
+    boundval = ConstantFP::get(*drv.context, APFloat(0.0));
+  if (!boundval)
+    return nullptr;
+  AllocaInst *Alloca = CreateEntryBlockAlloca(fun, Name.name);
+  drv.builder->CreateStore(boundval, Alloca);
   return Alloca;
 };
 
@@ -377,45 +1629,50 @@ AllocaInst *VarBindingsAST::codegen(driver &drv)
  *  viceversa si lavora con una variabile globale
  * 
  *  la dichiarazione di una nuova variabile viene fatta in modo uguale, ma con "contesto" diverso
+ *
+ *  con la forma indicizzata (id[exp] = exp) il valore viene scritto nell'elemento dell'array.
  */
-AssignmentExprAST::AssignmentExprAST(std::string Name, ExprAST *Val) : Name(Name), Val(Val) {};
-std::string &AssignmentExprAST::getName() { return Name; };
+AssignmentExprAST::AssignmentExprAST(Symbol Name, ExprAST *Val, ExprAST *Exp) : Name(Name), Val(Val), Exp(Exp) {};
+Symbol &AssignmentExprAST::getName() { return Name; };
 initType AssignmentExprAST::getType() { return ASSIGNMENT; };
 Value *AssignmentExprAST::codegen(driver &drv)
 {
-  AllocaInst *Variable = drv.NamedValues[Name];
   Value *boundval = Val->codegen(drv);
-  
   if (!boundval)
     return nullptr;
-  
-  if (!Variable)
-  {
-    GlobalVariable *globVar = module->getNamedGlobal(Name);
-    if (!globVar)
-      return nullptr;
 
-    builder->CreateStore(boundval, globVar);
-    return boundval;
-  }
+  Value *Variable = CreateVariableAddress(drv, Name, Exp);
+  if (!Variable)
+    return nullptr;
 
-  builder->CreateStore(boundval, Variable);
+  drv.builder->CreateStore(boundval, Variable);
   return boundval;
 };
 
 /** GlobalVariableAST 
  * la classe implementa la dichiarazione di una variabile globale; 
  * sfrutta interamente la firma llvm GlobalVariable
+ *
+ * con "global id[number]" si crea un array di double contiguo, azzerato e allineato
+ * alla linea di cache, su cui il vettorizzatore può lavorare.
  */
-GlobalVariableAST::GlobalVariableAST(std::string Name, double Size) : Name(Name), Size(Size) {}
-std::string &GlobalVariableAST::getName() { return Name; };
+GlobalVariableAST::GlobalVariableAST(Symbol Name, double Size) : Name(Name), Size(Size) {}
+Symbol &GlobalVariableAST::getName() { return Name; };
 Value *GlobalVariableAST::codegen(driver &drv)
 {
   GlobalVariable *globVar;
-  globVar = new GlobalVariable(*module, Type::getDoubleTy(*context), false, GlobalValue::CommonLinkage, ConstantFP::getNullValue(Type::getDoubleTy(*context)), Name);
+  if (Size > 0)
+  {
+    ArrayType *AT = ArrayType::get(Type::getDoubleTy(*drv.context), (uint64_t)Size);
+    globVar = new GlobalVariable(*drv.module, AT, false, GlobalValue::CommonLinkage, ConstantAggregateZero::get(AT), Name.name);
+    globVar->setAlignment(Align(64));
+  }
+  else
+    globVar = new GlobalVariable(*drv.module, Type::getDoubleTy(*drv.context), false, GlobalValue::CommonLinkage, ConstantFP::getNullValue(Type::getDoubleTy(*drv.context)), Name.name);
+  drv.bindGlobal(Name, globVar);
+  drv.addCacheContext("global " + Name.name.str() + "[" + std::to_string((int64_t)Size) + "]");
   
-  globVar->print(errs());
-  fprintf(stderr, "\n");
+  drv.emit(globVar);
   return globVar;
 }
 
@@ -454,7 +1711,7 @@ Value *GlobalVariableAST::codegen(driver &drv)
  */
 IfStmtAST::IfStmtAST(ExprAST *cond, StmtAST *trueblock, StmtAST *falseblock) : cond(cond), trueblock(trueblock), falseblock(falseblock) {};
 
-IfStmtAST::IfStmtAST(ExprAST *cond, StmtAST *trueblock) : cond(cond), trueblock(trueblock) {};
+IfStmtAST::IfStmtAST(ExprAST *cond, StmtAST *trueblock) : cond(cond), trueblock(trueblock), falseblock(nullptr) {};
 
 Value *IfStmtAST::codegen(driver &drv)
 {
@@ -462,133 +1719,328 @@ Value *IfStmtAST::codegen(driver &drv)
   if (!CondV)
     return nullptr;
 
-  Function *fun = builder->GetInsertBlock()->getParent();
-  BasicBlock *TrueBB = BasicBlock::Create(*context, "trueblock", fun);
-  BasicBlock *FalseBB = BasicBlock::Create(*context, "falseblock");
-  BasicBlock *MergeBB = BasicBlock::Create(*context, "mergeblock");
-  builder->CreateCondBr(CondV, TrueBB, FalseBB);
+  Function *fun = drv.builder->GetInsertBlock()->getParent();
+  BasicBlock *TrueBB = BasicBlock::Create(*drv.context, "trueblock", fun);
+  BasicBlock *FalseBB = BasicBlock::Create(*drv.context, "falseblock");
+  BasicBlock *MergeBB = BasicBlock::Create(*drv.context, "mergeblock");
+  CreateHintedCondBr(drv, cond, CondV, TrueBB, FalseBB);
 
   //* FASE 1 - blocco vero
-  builder->SetInsertPoint(TrueBB);
+  drv.builder->SetInsertPoint(TrueBB);
+  if (drv.profile)
+    drv.profileIncrement(drv.addProfileSite("if then", fun->getName(), line).count);
   Value *trueV = trueblock->codegen(drv);
   if (!trueV)
     return nullptr;
-  TrueBB = builder->GetInsertBlock();
-  builder->CreateBr(MergeBB);
+  TrueBB = drv.builder->GetInsertBlock();
+  drv.builder->CreateBr(MergeBB);
 
   //* FASE 2 - blocco falso
-  builder->SetInsertPoint(FalseBB);
+  drv.builder->SetInsertPoint(FalseBB);
   Value *falseV;
   fun->insert(fun->end(), FalseBB);
-  builder->SetInsertPoint(FalseBB);
+  drv.builder->SetInsertPoint(FalseBB);
+  if (drv.profile)
+    drv.profileIncrement(drv.addProfileSite("if else", fun->getName(), line).count);
   if (falseblock)
   {
     falseV = falseblock->codegen(drv);
     if (!falseV)
       return nullptr;
-    FalseBB = builder->GetInsertBlock();
+    FalseBB = drv.builder->GetInsertBlock();
   }
-  builder->CreateBr(MergeBB);
+  drv.builder->CreateBr(MergeBB);
   fun->insert(fun->end(), MergeBB);
-  builder->SetInsertPoint(MergeBB);
+  drv.builder->SetInsertPoint(MergeBB);
 
   //* FASE 3 - convergenza
-  PHINode *P = builder->CreatePHI(Type::getDoubleTy(*context), 2);
-  P->addIncoming(ConstantFP::getNullValue(Type::getDoubleTy(*context)), TrueBB);
-  P->addIncoming(ConstantFP::getNullValue(Type::getDoubleTy(*context)), FalseBB);
+  PHINode *P = drv.builder->CreatePHI(Type::getDoubleTy(*drv.context), 2);
+  P->addIncoming(ConstantFP::getNullValue(Type::getDoubleTy(*drv.context)), TrueBB);
+  P->addIncoming(ConstantFP::getNullValue(Type::getDoubleTy(*drv.context)), FalseBB);
   return P;
 };
 
 
 /**  FOR in AST
  *  la prima cosa che si implementa è il costruttore con le tre informazioni tipiche di un cilo for: 
- *  init, cond, step, e body.
+ *  init, cond, step, e body; a queste si aggiungono gli eventuali suggerimenti per l'ottimizzatore
+ *  (for vectorize(8) unroll(4) (...)).
  * 
- *  si prepara poi il blocco di inizializzazione e di condizione, e si descrive un'operazione di salto non condizionato:
- *  dopo aver eseguito l'inizializzazione, il flusso salta sempre a CondBB per valutare la condizione del ciclo.
+ *  il ciclo viene generato direttamente in forma "ruotata", quella che i passi di LLVM sui cicli
+ *  (LICM, unroll, loop-vectorize) si aspettano: la condizione è valutata una prima volta come guardia
+ *  e poi in fondo al ciclo, nel latch, da cui parte l'unico arco all'indietro.
+ *  Il codice della condizione compare quindi due volte, ma viene eseguito lo stesso numero di volte
+ *  della forma non ruotata (una volta prima di ogni iterazione e una all'uscita): le chiamate
+ *  nella condizione, come in for (...; f(i) < n; ...), avvengono nello stesso numero e ordine.
  *  
  *  * FASE 0 - preparativi 
- *  si configurano tutti i bb e l'istruzione di salto iniziale
+ *  si configurano i bb init, preheader, loop (header e corpo), latch ed endloop
  * 
- *  * FASE 1: inizializzazione ciclo
- *  si dichiara/riassegna la variabile di inizializzazione
- *  in caso la variabile esista già si fa un salvataggio di backup
- *  (che poi viene ripristinato)
+ *  * FASE 1: inizializzazione ciclo e guardia
+ *  si dichiara/riassegna la variabile di inizializzazione, aprendo uno scope
+ *  nel caso di una nuova dichiarazione; si valuta poi la condizione: se falsa si salta subito all'uscita
  * 
  *  * FASE 2: scrittura del corpo principale
- *  si scrive il flusso principale body->codegen(drv);
- *  e si impostano i salti: 
- *  . condizionati nel caso di valutazione condizione di ripetizione
- *  . non condizionati nel caso di ritorno alla condizione per verificare la possibilità di nuova iterazione
+ *  il preheader salta sempre al corpo; il corpo salta al latch, dove si scrive lo step,
+ *  si rivaluta la condizione e si torna al corpo o si esce.
+ *  sul salto del latch si aggancia il metadato llvm.loop, con i suggerimenti indicati nel sorgente
  *  
  *  * FASE 3: uscita da flusso for [si torna a casa]
  *  viene impostato il punto di inserimento al termine del ciclo for, 
- *  viene creato un nodo PHI per gestire i valori che provengono dai blocchi precedenti, 
- *  viene ripristinata la symbol table per ripristinare il valore precedente della variabile iniziale ev.
+ *  e si chiude lo scope della variabile di inizializzazione.
+ *
+ *  In caso di errore lo scope viene chiuso dal suo BlockScope e i blocchi non ancora inseriti nella
+ *  funzione vengono eliminati (o, se già destinazione di un salto, lasciati alla funzione,
+ *  che FunctionAST cancella).
  */
-ForStmtAST::ForStmtAST(InitAST *init, ExprAST *cond, AssignmentExprAST *step, StmtAST *body) : init(init), cond(cond), step(step), body(body) {};
+ForStmtAST::ForStmtAST(InitAST *init, ExprAST *cond, AssignmentExprAST *step, StmtAST *body, loopHints hints) : init(init), cond(cond), step(step), body(body), hints(hints) {};
+
+static MDNode *CreateLoopMetadata(LLVMContext &ctx, const loopHints &hints)
+{
+  Type *i32 = Type::getInt32Ty(ctx);
+  SmallVector<Metadata *, 4> MDs;
+  MDs.push_back(nullptr); // il primo operando punta al nodo stesso
+  if (hints.vectorize > 0)
+  {
+    MDs.push_back(MDNode::get(ctx, {MDString::get(ctx, "llvm.loop.vectorize.width"), ConstantAsMetadata::get(ConstantInt::get(i32, hints.vectorize))}));
+    MDs.push_back(MDNode::get(ctx, {MDString::get(ctx, "llvm.loop.vectorize.enable"), ConstantAsMetadata::get(ConstantInt::getBool(ctx, hints.vectorize > 1))}));
+  }
+  if (hints.unroll == 1)
+    MDs.push_back(MDNode::get(ctx, {MDString::get(ctx, "llvm.loop.unroll.disable")}));
+  else if (hints.unroll > 1)
+    MDs.push_back(MDNode::get(ctx, {MDString::get(ctx, "llvm.loop.unroll.count"), ConstantAsMetadata::get(ConstantInt::get(i32, hints.unroll))}));
+
+  MDNode *loopID = MDNode::getDistinct(ctx, MDs);
+  loopID->replaceOperandWith(0, loopID);
+  return loopID;
+}
+
 Value *ForStmtAST::codegen(driver &drv)
 {
   // * FASE 0 - preparativi 
-  Function *fun = builder->GetInsertBlock()->getParent();
+  Function *fun = drv.builder->GetInsertBlock()->getParent();
 
-  BasicBlock *InitBB = BasicBlock::Create(*context, "init", fun);
-  builder->CreateBr(InitBB);
+  BasicBlock *InitBB = BasicBlock::Create(*drv.context, "init", fun);
+  drv.builder->CreateBr(InitBB);
   
-  BasicBlock *CondBB = BasicBlock::Create(*context, "cond", fun);
-  BasicBlock *LoopBB = BasicBlock::Create(*context, "loop", fun);
-  BasicBlock *EndLoop = BasicBlock::Create(*context, "endloop", fun);
+  BasicBlock *PreheaderBB = BasicBlock::Create(*drv.context, "preheader", fun);
+  BasicBlock *LoopBB = BasicBlock::Create(*drv.context, "loop", fun);
+  BasicBlock *LatchBB = BasicBlock::Create(*drv.context, "latch");
+  BasicBlock *EndLoop = BasicBlock::Create(*drv.context, "endloop");
 
-  builder->SetInsertPoint(InitBB);
+  drv.builder->SetInsertPoint(InitBB);
+  auto fail = [&]() -> Value *
+  {
+    for (BasicBlock *BB : {LatchBB, EndLoop})
+      if (!BB->getParent())
+      {
+        if (BB->use_empty())
+          delete BB;
+        else
+          fun->insert(fun->end(), BB);
+      }
+    return nullptr;
+  };
+  std::optional<BlockScope> scope;
 
-  // * FASE 1 - inizializzazione ciclo
-  std::string varName = init->getName();
-  AllocaInst *oldVar;
+  // * FASE 1 - inizializzazione ciclo e guardia
   Value *initVal = init->codegen(drv);
-  ;
   if (!initVal)
-    return nullptr;
+    return fail();
+  // l'array non avrebbe un blocco che ne chiuda la vita con llvm.lifetime.end
+  if (init->getType() == BINDING && ((AllocaInst *)initVal)->getAllocatedType()->isArrayTy())
+  {
+    LogErrorV("array declared in for initialization: " + init->getName().name.str());
+    return fail();
+  }
   if (init->getType() == BINDING)
   {
-    oldVar = drv.NamedValues[varName];
-    drv.NamedValues[varName] = (AllocaInst *)initVal;
+    scope.emplace(drv);
+    drv.NamedValues.bind(init->getName().id, (AllocaInst *)initVal);
   }
-  builder->CreateBr(CondBB);
+  Value *guardVal = cond->codegen(drv);
+  if (!guardVal)
+    return fail();
+  CreateHintedCondBr(drv, cond, guardVal, PreheaderBB, EndLoop);
 
   // * FASE 2 - scrittura del corpo principale
-  builder->SetInsertPoint(CondBB);
-  Value *condVal = cond->codegen(drv);
-  if (!condVal)
-    return nullptr;
-  
-  // si salta alla condizione (obv salto condizionato)
-  builder->CreateCondBr(condVal, LoopBB, EndLoop);
+  drv.builder->SetInsertPoint(PreheaderBB);
+  drv.builder->CreateBr(LoopBB);
 
-  // si scrive veramente il body
-  builder->SetInsertPoint(LoopBB);
+  // si scrive veramente il body (con --profile si contano le iterazioni)
+  drv.builder->SetInsertPoint(LoopBB);
+  if (drv.profile)
+    drv.profileIncrement(drv.addProfileSite("for", fun->getName(), line).count);
   Value *bodyVal = body->codegen(drv);
   if (!bodyVal)
-    return nullptr;
+    return fail();
+  drv.builder->CreateBr(LatchBB);
 
-  // scrittura codice per avanzare -> nextIterat
+  // latch: scrittura codice per avanzare -> nextIterat, e nuova valutazione della condizione
+  fun->insert(fun->end(), LatchBB);
+  drv.builder->SetInsertPoint(LatchBB);
   Value *stepVal = step->codegen(drv);
   if (!stepVal)
-    return nullptr;
-
-  // si torna indietro alla condizione (anche questa volta, non cond.)
-  builder->CreateBr(CondBB);
+    return fail();
+  Value *condVal = cond->codegen(drv);
+  if (!condVal)
+    return fail();
+  BranchInst *backedge = CreateHintedCondBr(drv, cond, condVal, LoopBB, EndLoop);
+  backedge->setMetadata(LLVMContext::MD_loop, CreateLoopMetadata(*drv.context, hints));
 
   // * FASE 3 - uscita da flusso for [si torna a casa]
-  builder->SetInsertPoint(EndLoop);
-  PHINode *P = builder->CreatePHI(Type::getDoubleTy(*context), 1);
-  P->addIncoming(ConstantFP::getNullValue(Type::getDoubleTy(*context)), CondBB);
+  fun->insert(fun->end(), EndLoop);
+  drv.builder->SetInsertPoint(EndLoop);
 
-  if (init->getType() == BINDING)
+  // lo scope della variabile di inizializzazione viene chiuso dal distruttore di scope
+  return ConstantFP::getNullValue(Type::getDoubleTy(*drv.context));
+};
+
+// attributi di funzione corrispondenti ai FastMathFlags, letti dal backend
+static void setFastMathAttributes(Function *F, FastMathFlags FMF)
+{
+  if (!FMF.isFast())
+    return;
+  F->addFnAttr("unsafe-fp-math", "true");
+  F->addFnAttr("no-nans-fp-math", "true");
+  F->addFnAttr("no-infs-fp-math", "true");
+  F->addFnAttr("no-signed-zeros-fp-math", "true");
+  F->addFnAttr("approx-func-fp-math", "true");
+}
+
+/** ParFor in AST
+ *  parfor (i = start, end) body esegue il corpo per i = start, ..., end-1 in parallelo.
+ *  Il corpo viene estratto in una funzione interna <funzione>.parfor(env, begin, end),
+ *  che esegue un chunk di iterazioni; il ciclo diventa una chiamata a __kcomp_parfor,
+ *  implementata dal runtime (runtime.cpp), che divide l'intervallo in chunk e li distribuisce
+ *  sul suo pool di thread.
+ *
+ *  * FASE 1 - ambiente
+ *  le variabili scalari visibili nel punto del parfor vengono copiate in un array di double (env),
+ *  passato alla funzione estratta: nel corpo sono quindi visibili per valore, e un assegnamento
+ *  resta locale al chunk. Gli array locali non sono visibili nel corpo; le variabili globali
+ *  sono condivise fra i thread, ed è compito del programma non scrivere due volte lo stesso elemento.
+ *
+ *  * FASE 2 - funzione estratta
+ *  si salva il punto di inserimento corrente e si scrive la funzione: le copie delle variabili
+ *  dell'ambiente, la variabile di ciclo e un ciclo ruotato su un contatore intero [begin, end),
+ *  con il metadato llvm.loop dei suggerimenti indicati nel sorgente.
+ *
+ *  * FASE 3 - chiamata al runtime
+ *  si ripristina il punto di inserimento e si chiama __kcomp_parfor(funzione, env, start, end)
+ */
+ParForStmtAST::ParForStmtAST(Symbol Var, ExprAST *start, ExprAST *end, StmtAST *body, loopHints hints) : Var(Var), start(start), end(end), body(body), hints(hints) {};
+
+// dichiarazione di void __kcomp_parfor(ptr, ptr, i64, i64), aggiunta al modulo al primo uso
+static Function *getParforRuntime(driver &drv)
+{
+  if (Function *F = drv.module->getFunction("__kcomp_parfor"))
+    return F;
+  PointerType *ptrTy = PointerType::getUnqual(*drv.context);
+  Type *i64 = Type::getInt64Ty(*drv.context);
+  FunctionType *FT = FunctionType::get(Type::getVoidTy(*drv.context), {ptrTy, ptrTy, i64, i64}, false);
+  Function *F = Function::Create(FT, Function::ExternalLinkage, "__kcomp_parfor", *drv.module);
+  drv.emit(F);
+  return F;
+}
+
+Value *ParForStmtAST::codegen(driver &drv)
+{
+  LLVMContext &ctx = *drv.context;
+  Type *doubleTy = Type::getDoubleTy(ctx);
+  Type *i64 = Type::getInt64Ty(ctx);
+  Function *fun = drv.builder->GetInsertBlock()->getParent();
+
+  Value *startVal = start->codegen(drv);
+  if (!startVal)
+    return nullptr;
+  Value *endVal = end->codegen(drv);
+  if (!endVal)
+    return nullptr;
+  startVal = drv.builder->CreateFPToSI(startVal, i64, "parfor.start");
+  endVal = drv.builder->CreateFPToSI(endVal, i64, "parfor.end");
+
+  // * FASE 1 - ambiente
+  std::vector<std::pair<unsigned, AllocaInst *>> captured;
+  for (auto &B : drv.NamedValues.visible())
+    if (!B.second->getAllocatedType()->isArrayTy())
+      captured.push_back(B);
+
+  ArrayType *envTy = ArrayType::get(doubleTy, captured.size());
+  AllocaInst *env = CreateEntryBlockAlloca(fun, "parfor.env", envTy);
+  for (unsigned k = 0; k < captured.size(); k++)
   {
-    drv.NamedValues[varName] = oldVar;
+    Value *V = drv.builder->CreateLoad(doubleTy, captured[k].second, captured[k].second->getName());
+    drv.builder->CreateStore(V, drv.builder->CreateConstInBoundsGEP2_64(envTy, env, 0, k));
   }
 
-  return P;
+  // * FASE 2 - funzione estratta
+  PointerType *ptrTy = PointerType::getUnqual(ctx);
+  FunctionType *FT = FunctionType::get(Type::getVoidTy(ctx), {ptrTy, i64, i64}, false);
+  Function *outlined = Function::Create(FT, Function::InternalLinkage, fun->getName() + ".parfor", *drv.module);
+  setFastMathAttributes(outlined, drv.builder->getFastMathFlags());
+  Argument *envArg = outlined->getArg(0);
+  Argument *beginArg = outlined->getArg(1);
+  Argument *endArg = outlined->getArg(2);
+  envArg->setName("env");
+  beginArg->setName("begin");
+  endArg->setName("end");
+
+  IRBuilderBase::InsertPoint savedIP = drv.builder->saveIP();
+  BasicBlock *EntryBB = BasicBlock::Create(ctx, "entry", outlined);
+  BasicBlock *LoopBB = BasicBlock::Create(ctx, "loop", outlined);
+  BasicBlock *LatchBB = BasicBlock::Create(ctx, "latch");
+  BasicBlock *ExitBB = BasicBlock::Create(ctx, "exit");
+
+  drv.builder->SetInsertPoint(EntryBB);
+  drv.NamedValues.enterFunction();
+  for (unsigned k = 0; k < captured.size(); k++)
+  {
+    AllocaInst *A = CreateEntryBlockAlloca(outlined, captured[k].second->getName());
+    Value *V = drv.builder->CreateLoad(doubleTy, drv.builder->CreateConstInBoundsGEP2_64(envTy, envArg, 0, k));
+    drv.builder->CreateStore(V, A);
+    drv.NamedValues.bind(captured[k].first, A);
+  }
+  AllocaInst *IndVar = CreateEntryBlockAlloca(outlined, Var.name);
+  drv.NamedValues.bind(Var.id, IndVar);
+  drv.builder->CreateCondBr(drv.builder->CreateICmpSLT(beginArg, endArg), LoopBB, ExitBB);
+
+  drv.builder->SetInsertPoint(LoopBB);
+  PHINode *idx = drv.builder->CreatePHI(i64, 2, "idx");
+  idx->addIncoming(beginArg, EntryBB);
+  drv.builder->CreateStore(drv.builder->CreateSIToFP(idx, doubleTy), IndVar);
+  Value *bodyVal = body->codegen(drv);
+  drv.NamedValues.exitFunction();
+  if (!bodyVal)
+  {
+    drv.builder->restoreIP(savedIP);
+    outlined->eraseFromParent();
+    return nullptr;
+  }
+  drv.builder->CreateBr(LatchBB);
+
+  outlined->insert(outlined->end(), LatchBB);
+  drv.builder->SetInsertPoint(LatchBB);
+  Value *next = drv.builder->CreateAdd(idx, ConstantInt::get(i64, 1), "next", false, true);
+  idx->addIncoming(next, LatchBB);
+  BranchInst *backedge = drv.builder->CreateCondBr(drv.builder->CreateICmpSLT(next, endArg), LoopBB, ExitBB);
+  backedge->setMetadata(LLVMContext::MD_loop, CreateLoopMetadata(ctx, hints));
+
+  outlined->insert(outlined->end(), ExitBB);
+  drv.builder->SetInsertPoint(ExitBB);
+  drv.builder->CreateRetVoid();
+  verifyFunction(*outlined);
+  drv.optimizeFunction(*outlined);
+
+  // * FASE 3 - chiamata al runtime
+  drv.builder->restoreIP(savedIP);
+  if (drv.profile)
+    drv.profileIncrement(drv.addProfileSite("parfor", fun->getName(), line).count);
+  Function *runtime = getParforRuntime(drv);
+  drv.builder->CreateCall(runtime, {outlined, env, startVal, endVal});
+  drv.emit(outlined);
+
+  return ConstantFP::getNullValue(doubleTy);
 };
 
 /** Prototype, Function in AST
@@ -610,15 +2062,20 @@ Value *ForStmtAST::codegen(driver &drv)
  *
  *  Il meccanismo viene spiegato approfonditamente nel readme esterno dedicato. 
  */
-PrototypeAST::PrototypeAST(std::string Name, std::vector<std::string> Args) : Name(Name), Args(std::move(Args)), emitcode(true) {}; // Di regola il codice viene emesso
+PrototypeAST::PrototypeAST(Symbol Name, std::vector<Symbol> Args) : Name(Name), Args(std::move(Args)), emitcode(true) {}; // Di regola il codice viene emesso
 
 lexval PrototypeAST::getLexVal() const
 {
-  lexval lval = Name;
+  lexval lval = Name.name.str();
   return lval;
 };
 
-const std::vector<std::string> &PrototypeAST::getArgs() const
+const Symbol &PrototypeAST::getName() const
+{
+  return Name;
+};
+
+const std::vector<Symbol> &PrototypeAST::getArgs() const
 {
   return Args;
 };
@@ -628,61 +2085,419 @@ void PrototypeAST::noemit()
   emitcode = false;
 };
 
+// interfaccia di un prototipo nella chiave della cache di funzione: le chiamate dipendono dall'arietà
+// e, per gli extern, da -fno-builtin, perché solo le dichiarazioni vengono tradotte in intrinseci
+static std::string prototypeContext(const PrototypeAST *P, bool external, bool builtins)
+{
+  std::string arity = P->getName().name.str() + "/" + std::to_string(P->getArgs().size());
+  return external ? "extern " + arity + (builtins ? " builtin" : "") : "def " + arity;
+}
+
 Function *PrototypeAST::codegen(driver &drv)
 {
-  std::vector<Type *> Doubles(Args.size(), Type::getDoubleTy(*context));
-  FunctionType *FT = FunctionType::get(Type::getDoubleTy(*context), Doubles, false);
-  Function *F = Function::Create(FT, Function::ExternalLinkage, Name, *module);
+  std::vector<Type *> Doubles(Args.size(), Type::getDoubleTy(*drv.context));
+  FunctionType *FT = FunctionType::get(Type::getDoubleTy(*drv.context), Doubles, false);
+  Function *F = Function::Create(FT, Function::ExternalLinkage, Name.name, *drv.module);
+  // un secondo prototipo con lo stesso nome viene rinominato da LLVM: resta valido il primo
+  if (F->getName() == Name.name)
+    drv.bindFunction(Name, F);
+  drv.addCacheContext(prototypeContext(this, emitcode, drv.builtins));
 
   unsigned Idx = 0;
   for (auto &Arg : F->args())
-    Arg.setName(Args[Idx++]);
+    Arg.setName(Args[Idx++].name);
 
   if (emitcode)
-  {
-    F->print(errs());
-    fprintf(stderr, "\n");
-  };
+    drv.emit(F);
 
   return F;
 }
 
 
-FunctionAST::FunctionAST(PrototypeAST *Proto, ExprAST *Body) : Proto(Proto), Body(Body) {};
+FunctionAST::FunctionAST(PrototypeAST *Proto, ExprAST *Body, funQualifiers qual) : Proto(Proto), Body(Body), qual(qual), selfTailCalls(false), expanding(false) {};
+
+/*  Fast-math
+ *  --ffast-math vale per tutte le funzioni del modulo, "def fast f(x) ..." per la sola f;
+ *  --fp-contract=fast permette soltanto la contrazione di mul e add in fma.
+ *  I flag vengono impostati sul builder per tutta la generazione della funzione (e quindi
+ *  su ogni operazione in virgola mobile), e riportati negli attributi della funzione per il backend.
+ */
+FastMathFlags driver::getFastMathFlags(bool fastFunction) const
+{
+  FastMathFlags FMF;
+  if (fastMath || fastFunction)
+    FMF.setFast();
+  else if (fpContractFast)
+    FMF.setAllowContract();
+  return FMF;
+}
 
 Function *FunctionAST::codegen(driver &drv)
 {
-  Function *function = module->getFunction(std::get<std::string>(Proto->getLexVal()));
+  Function *function = drv.lookupFunction(Proto->getName());
 
-  if (!function)
-    function = Proto->codegen(drv);
-  else
+  if (function)
     return nullptr;
 
+  // --cache-dir: la stessa definizione, compilata nello stesso contesto, viene ripresa dalla cache
+  std::string entry = drv.functionCacheEntry(source);
+  if (Function *cached = drv.loadCachedFunction(entry, Proto->getName()))
+  {
+    drv.addCacheContext(prototypeContext(Proto, false, drv.builtins));
+    if (cached->hasFnAttribute(Attribute::AlwaysInline) || cached->hasFnAttribute(Attribute::InlineHint))
+    {
+      drv.bindInline(Proto->getName(), this);
+      drv.addCacheContext("inline " + source);
+    }
+    drv.emit(cached);
+    return cached;
+  }
+
+  function = Proto->codegen(drv);
+
   if (!function)
     return nullptr;
 
-  BasicBlock *BB = BasicBlock::Create(*context, "entry", function);
-  builder->SetInsertPoint(BB);
-
+  BasicBlock *BB = BasicBlock::Create(*drv.context, "entry", function);
+  drv.builder->SetInsertPoint(BB);
+  FastMathFlags FMF = drv.getFastMathFlags(qual.fast);
+  drv.builder->setFastMathFlags(FMF);
+  setFastMathAttributes(function, FMF);
+
+  // i parametri formano lo scope più esterno della funzione
+  drv.NamedValues.clear();
+  drv.liveArrays.clear();
+  drv.NamedValues.enterScope();
+  std::vector<AllocaInst *> ArgAllocas;
   for (auto &Arg : function->args())
   {
     AllocaInst *Alloca = CreateEntryBlockAlloca(function, Arg.getName());
-    builder->CreateStore(&Arg, Alloca);
-    drv.NamedValues[std::string(Arg.getName())] = Alloca;
+    drv.builder->CreateStore(&Arg, Alloca);
+    drv.NamedValues.bind(Proto->getArgs()[Arg.getArgNo()].id, Alloca);
+    ArgAllocas.push_back(Alloca);
   }
 
-  if (Value *RetVal = Body->codegen(drv))
+  // --profile: chiamate della funzione e, con --profile=cycles, cicli fra ingresso e ret
+  profileSite site{};
+  Value *startCycles = nullptr;
+  if (drv.profile)
   {
-    builder->CreateRet(RetVal);
+    site = drv.addProfileSite("function", function->getName(), line, true);
+    drv.profileIncrement(site.count);
+    if (site.cycles)
+      startCycles = drv.builder->CreateIntrinsic(Intrinsic::readcyclecounter, {}, {}, nullptr, "prof.start");
+  }
 
-    verifyFunction(*function);
+  // con chiamate ricorsive in coda il corpo diventa un ciclo: le chiamate saltano a tailrecurse
+  if (selfTailCalls)
+  {
+    BasicBlock *LoopBB = BasicBlock::Create(*drv.context, "tailrecurse", function);
+    drv.builder->CreateBr(LoopBB);
+    drv.builder->SetInsertPoint(LoopBB);
+    drv.tailRecurse = LoopBB;
+    drv.tailArgs = std::move(ArgAllocas);
+  }
 
-    function->print(errs());
-    fprintf(stderr, "\n");
+  Value *RetVal = Body->codegen(drv);
+  drv.builder->clearFastMathFlags();
+  drv.tailRecurse = nullptr;
+  if (RetVal)
+  {
+    // una chiamata seguita direttamente dal ret, con lo stesso prototipo, può essere musttail
+    CallInst *call = dyn_cast<CallInst>(RetVal);
+    if (call && call->isTailCall() && call == &drv.builder->GetInsertBlock()->back() &&
+        call->getFunctionType() == function->getFunctionType() && !startCycles)
+      call->setTailCallKind(CallInst::TCK_MustTail);
+    if (startCycles)
+    {
+      Value *endCycles = drv.builder->CreateIntrinsic(Intrinsic::readcyclecounter, {}, {}, nullptr, "prof.end");
+      drv.profileIncrement(site.cycles, drv.builder->CreateSub(endCycles, startCycles, "prof.elapsed"));
+    }
+    drv.builder->CreateRet(RetVal);
+
+    {
+      PhaseTimer timer(drv.stats, "verify");
+      verifyFunction(*function);
+    }
+    if (drv.stats.enabled)
+    {
+      drv.stats.functions++;
+      drv.stats.irInstructions += function->getInstructionCount();
+    }
+
+    // funzioni inline o piccole (misurate sull'IR non ottimizzato) e non ricorsive: espanse nei chiamanti
+    bool recursive = selfTailCalls;
+    for (User *U : function->users())
+      if (Instruction *I = dyn_cast<Instruction>(U))
+        recursive = recursive || I->getFunction() == function;
+    if (!recursive && (qual.inlined || function->getInstructionCount() <= drv.inlineThreshold))
+    {
+      function->addFnAttr(qual.inlined ? Attribute::AlwaysInline : Attribute::InlineHint);
+      if (!drv.profile)
+        drv.bindInline(Proto->getName(), this);
+      drv.addCacheContext("inline " + source);
+    }
+    drv.optimizeFunction(*function);
+    drv.storeCachedFunction(entry, function);
+
+    drv.emit(function);
     return function;
   }
 
+  drv.bindFunction(Proto->getName(), nullptr);
   function->eraseFromParent();
   return nullptr;
 };
+
+/*  Semplificazione dell'AST
+ *  Prima della generazione del codice l'albero viene visitato una volta con simplify: ogni nodo
+ *  semplifica i propri figli e restituisce il nodo che deve prenderne il posto (se stesso
+ *  o un nodo più semplice, allocato nell'arena). Così anche a -O0 arriva a LLVM meno lavoro.
+ *
+ *  Le riscritture applicate sempre lasciano invariato il risultato in virgola mobile:
+ *    - operazioni aritmetiche fra costanti, calcolate in double come farebbe il codice generato
+ *    - x*1, 1*x, x/1, x-0, x+(-0) -> x
+ *    - x*(-1), (-0)-x -> -x (fneg)
+ *    - x/c -> x*(1/c) quando c è una potenza di due, per cui 1/c è esatto
+ *  Con fastMath (--ffast-math) si accettano anche le riscritture che ignorano il segno dello zero
+ *  e i NaN: x+0, 0+x -> x, 0-x -> -x, x*0 -> 0, x/c -> x*(1/c) per ogni c.
+ */
+bool NumberExprAST::isNumber(double &V) const
+{
+  V = Val;
+  return true;
+};
+
+SeqAST *SeqAST::simplify(driver &drv)
+{
+  for (RootAST *&item : items)
+    item = item->simplify(drv);
+  return this;
+};
+
+ExprAST *VariableExprAST::simplify(driver &drv)
+{
+  if (Exp)
+    Exp = Exp->simplify(drv);
+  return this;
+};
+
+static bool isExactReciprocal(double C)
+{
+  int exp;
+  return std::isnormal(C) && std::frexp(C, &exp) == 0.5 && std::isnormal(1 / C);
+}
+
+ExprAST *BinaryExprAST::simplify(driver &drv)
+{
+  if (LHS)
+    LHS = LHS->simplify(drv);
+  RHS = RHS->simplify(drv);
+
+  double L, R;
+  bool lconst = LHS && LHS->isNumber(L);
+  bool rconst = RHS->isNumber(R);
+
+  // operatori unari: -x e not
+  if (!LHS)
+  {
+    if (Op == '-' && rconst)
+      return drv.make<NumberExprAST>(-R);
+    return this;
+  }
+
+  if (lconst && rconst)
+    switch (Op)
+    {
+    case '+':
+      return drv.make<NumberExprAST>(L + R);
+    case '-':
+      return drv.make<NumberExprAST>(L - R);
+    case '*':
+      return drv.make<NumberExprAST>(L * R);
+    case '/':
+      return drv.make<NumberExprAST>(L / R);
+    }
+
+  switch (Op)
+  {
+  case '+':
+    if (rconst && R == 0 && (std::signbit(R) || drv.fastMath))
+      return LHS;
+    if (lconst && L == 0 && (std::signbit(L) || drv.fastMath))
+      return RHS;
+    break;
+  case '-':
+    if (rconst && R == 0 && (!std::signbit(R) || drv.fastMath))
+      return LHS;
+    if (lconst && L == 0 && (std::signbit(L) || drv.fastMath))
+      return drv.make<BinaryExprAST>('-', nullptr, RHS);
+    break;
+  case '*':
+    if (rconst && R == 1)
+      return LHS;
+    if (lconst && L == 1)
+      return RHS;
+    if (rconst && R == -1)
+      return drv.make<BinaryExprAST>('-', nullptr, LHS);
+    if (lconst && L == -1)
+      return drv.make<BinaryExprAST>('-', nullptr, RHS);
+    if (drv.fastMath && ((rconst && R == 0) || (lconst && L == 0)))
+      return drv.make<NumberExprAST>(0);
+    break;
+  case '/':
+    if (rconst && R == 1)
+      return LHS;
+    if (rconst && (isExactReciprocal(R) || (drv.fastMath && R != 0)))
+      return drv.make<BinaryExprAST>('*', LHS, drv.make<NumberExprAST>(1 / R));
+    break;
+  }
+  return this;
+};
+
+ExprAST *CallExprAST::simplify(driver &drv)
+{
+  for (ExprAST *&Arg : Args)
+    Arg = Arg->simplify(drv);
+  return this;
+};
+
+ExprAST *IfExprAST::simplify(driver &drv)
+{
+  cond = cond->simplify(drv);
+  trueexp = trueexp->simplify(drv);
+  falseexp = falseexp->simplify(drv);
+  return this;
+};
+
+ExprAST *BlockAST::simplify(driver &drv)
+{
+  for (InitAST *&D : Def)
+    D = D->simplify(drv);
+  for (StmtAST *&S : Stmts)
+    S = S->simplify(drv);
+  return this;
+};
+
+InitAST *VarBindingsAST::simplify(driver &drv)
+{
+  if (Val)
+    Val = Val->simplify(drv);
+  return this;
+};
+
+AssignmentExprAST *AssignmentExprAST::simplify(driver &drv)
+{
+  Val = Val->simplify(drv);
+  if (Exp)
+    Exp = Exp->simplify(drv);
+  return this;
+};
+
+StmtAST *IfStmtAST::simplify(driver &drv)
+{
+  cond = cond->simplify(drv);
+  trueblock = trueblock->simplify(drv);
+  if (falseblock)
+    falseblock = falseblock->simplify(drv);
+  return this;
+};
+
+StmtAST *ForStmtAST::simplify(driver &drv)
+{
+  init = init->simplify(drv);
+  cond = cond->simplify(drv);
+  step = step->simplify(drv);
+  body = body->simplify(drv);
+  return this;
+};
+
+StmtAST *ParForStmtAST::simplify(driver &drv)
+{
+  start = start->simplify(drv);
+  end = end->simplify(drv);
+  body = body->simplify(drv);
+  return this;
+};
+
+/*  Espansione in linea
+ *  Una chiamata a una funzione registrata con bindInline (definita prima nello stesso file,
+ *  dichiarata inline o sotto la soglia --inline-threshold, non ricorsiva) non diventa una call:
+ *  il corpo della funzione viene generato di nuovo nel punto della chiamata. Vale anche a -O0 e
+ *  con --jit, dove l'inliner di LLVM non viene eseguito; per le pipeline ottimizzate la funzione
+ *  riceve comunque alwaysinline o inlinehint.
+ *
+ *  Gli argomenti, già valutati, vengono copiati in alloca del chiamante; il corpo è generato
+ *  oltre una barriera della symbol table che nasconde tutte le variabili del chiamante, così che gli identificatori del corpo
+ *  vedano solo i parametri e le variabili globali, come nella funzione originale.
+ *  Il corpo usa i propri FastMathFlags, e le sue chiamate in coda non saltano al tailrecurse del chiamante.
+ *  Una chiamata alla funzione dall'interno della sua stessa espansione (ad esempio dal corpo di un
+ *  parfor, estratto in un'altra funzione) resta una call normale.
+ */
+Value *FunctionAST::codegenInline(driver &drv, const std::vector<Value *> &Args)
+{
+  if (expanding)
+    return nullptr;
+  Function *caller = drv.builder->GetInsertBlock()->getParent();
+  std::vector<AllocaInst *> params;
+  for (unsigned i = 0; i < Args.size(); i++)
+  {
+    AllocaInst *Alloca = CreateEntryBlockAlloca(caller, Proto->getArgs()[i].name);
+    drv.builder->CreateStore(Args[i], Alloca);
+    params.push_back(Alloca);
+  }
+
+  drv.NamedValues.enterFunction();
+  for (unsigned i = 0; i < params.size(); i++)
+    drv.NamedValues.bind(Proto->getArgs()[i].id, params[i]);
+
+  BasicBlock *callerTailRecurse = drv.tailRecurse;
+  FastMathFlags callerFMF = drv.builder->getFastMathFlags();
+  drv.tailRecurse = nullptr;
+  drv.builder->setFastMathFlags(drv.getFastMathFlags(qual.fast));
+  expanding = true;
+  Value *V = Body->codegen(drv);
+  expanding = false;
+  drv.builder->setFastMathFlags(callerFMF);
+  drv.tailRecurse = callerTailRecurse;
+  drv.NamedValues.exitFunction();
+  return V;
+};
+
+FunctionAST *FunctionAST::simplify(driver &drv)
+{
+  // in una funzione "fast" valgono anche le riscritture di --ffast-math
+  bool moduleFastMath = drv.fastMath;
+  drv.fastMath = drv.fastMath || qual.fast;
+  if (Body)
+  {
+    Body = Body->simplify(drv);
+    selfTailCalls = Body->markTailCalls(Proto->getName().id);
+  }
+  drv.fastMath = moduleFastMath;
+  return this;
+};
+
+/*  Chiamate in coda
+ *  markTailCalls visita le posizioni di coda del corpo di una funzione, cioè le espressioni il cui
+ *  valore è il valore restituito: l'ultima istruzione di un blocco e i due rami di un'espressione
+ *  condizionale. Le chiamate trovate vengono marcate; il risultato indica se fra queste c'è una
+ *  chiamata alla funzione stessa (self), che FunctionAST trasformerà in un ciclo.
+ */
+bool CallExprAST::markTailCalls(unsigned self)
+{
+  tail = true;
+  return Callee.id == self;
+};
+
+bool IfExprAST::markTailCalls(unsigned self)
+{
+  bool t = trueexp->markTailCalls(self);
+  bool f = falseexp->markTailCalls(self);
+  return t || f;
+};
+
+bool BlockAST::markTailCalls(unsigned self)
+{
+  return !Stmts.empty() && Stmts.back()->markTailCalls(self);
+};
@@ -2,20 +2,57 @@
 #define DRIVER_HPP
 
 #include "llvm/ADT/APFloat.h"
+#include "llvm/ADT/SetVector.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringSwitch.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/ExecutionEngine/Orc/ThreadSafeModule.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/InstIterator.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/MDBuilder.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Type.h"
 #include "llvm/IR/Verifier.h"
 #include "llvm/IR/GlobalVariable.h"
-
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IRReader/IRReader.h"
+#include "llvm/Linker/Linker.h"
+#include "llvm/MC/TargetRegistry.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Passes/StandardInstrumentations.h"
+#include "llvm/Support/Allocator.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/FormatVariadic.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/TimeProfiler.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Target/TargetOptions.h"
+#include "llvm/Transforms/IPO/Internalize.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
 #include <cstdio>
 #include <cstdlib>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
 #include <string>
 #include <vector>
 #include <variant>
@@ -24,17 +61,176 @@
 
 using namespace llvm;
 
+// lo scanner è rientrante: lo stato di flex vive nel driver e viene passato a yylex_r
 #define YY_DECL \
-  yy::parser::symbol_type yylex(driver &drv)
+  yy::parser::symbol_type yylex_r(driver &drv, void *yyscanner)
 
 YY_DECL;
+yy::parser::symbol_type yylex(driver &drv);
+
+enum emitType
+{
+  EMIT_IR,
+  EMIT_OBJECT,
+  EMIT_ASSEMBLY,
+  EMIT_BITCODE
+};
+
+
+/*  Arena per i nodi dell'AST
+ *  I nodi vengono costruiti in blocchi contigui di un BumpPtrAllocator invece che con una new
+ *  per nodo; l'arena tiene traccia dei nodi costruiti per poterne chiamare i distruttori
+ *  e restituisce tutta la memoria in un colpo solo con release().
+ */
+class ASTArena
+{
+private:
+  BumpPtrAllocator allocator;
+  std::vector<RootAST *> nodes;
+
+public:
+  ~ASTArena();
+  template <typename T, typename... Args>
+  T *make(Args &&...args)
+  {
+    T *node = new (allocator.Allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+    nodes.push_back(node);
+    return node;
+  }
+  void release();
+  size_t getNodeCount() const;
+  size_t getBytesAllocated() const;
+  size_t getSlabCount() const;
+};
+
+
+/*  Symbol table a scope annidati
+ *  Il binding corrente di ogni identificatore è indicizzato direttamente con l'id assegnato
+ *  dallo scanner, quindi la ricerca non confronta stringhe e non inserisce nulla.
+ *  Ogni bind salva il binding mascherato; l'uscita da uno scope estrae il marcatore
+ *  dello scope e ripristina soltanto i binding introdotti al suo interno.
+ *  enterFunction apre uno scope che fa da barriera (corpo espanso in linea, corpo di parfor):
+ *  ogni binding ricorda la funzione in cui è stato fatto e lookup ignora quelli esterni,
+ *  così le variabili del chiamante vengono nascoste senza rilegarle una per una.
+ */
+class SymbolTable
+{
+private:
+  struct Binding
+  {
+    AllocaInst *alloca;
+    unsigned frame;
+  };
+  std::vector<Binding> bindings;
+  std::vector<std::pair<unsigned, Binding>> shadowed;
+  std::vector<size_t> scopes;
+  std::vector<std::pair<unsigned, size_t>> frames;
+  unsigned frame = 0;
+  unsigned frameCount = 0;
+
+public:
+  void enterScope();
+  void exitScope();
+  void enterFunction();
+  void exitFunction();
+  void bind(unsigned id, AllocaInst *A);
+  AllocaInst *lookup(unsigned id) const;
+  std::vector<std::pair<unsigned, AllocaInst *>> visible() const;
+  void clear();
+};
+
+
+/*  Statistiche di compilazione (--time-report)
+ *  Tempi delle fasi, accumulati per nome dai PhaseTimer, e contatori raccolti durante
+ *  la compilazione; con -j le statistiche delle unità vengono sommate in quelle del driver principale.
+ */
+class CompileStats
+{
+public:
+  bool enabled = false;
+  std::vector<std::pair<std::string, double>> phases;
+  uint64_t tokens = 0;
+  uint64_t astNodes = 0;
+  uint64_t astBytes = 0;
+  uint64_t astAllocations = 0;
+  uint64_t functions = 0;
+  uint64_t irInstructions = 0;
+  uint64_t optimizedInstructions = 0;
+  uint64_t cacheHits = 0;
+  uint64_t cacheMisses = 0;
+  void addPhase(StringRef name, double seconds);
+  void merge(const CompileStats &other);
+  void printTable(raw_ostream &OS) const;
+  void printJSON(raw_ostream &OS) const;
+};
+
+/*  Timer di una fase, attivo per tutto lo scope in cui è dichiarato: il tempo viene aggiunto alle
+ *  statistiche (se abilitate) e la fase compare nella traccia di --time-trace (se attiva).
+ */
+class PhaseTimer
+{
+private:
+  CompileStats &stats;
+  const char *name;
+  std::chrono::steady_clock::time_point start;
+  TimeTraceScope trace;
+
+public:
+  PhaseTimer(CompileStats &stats, const char *name);
+  ~PhaseTimer();
+};
+
+
+/*  Cache di compilazione su disco (--cache-dir=<dir>, KCOMP_CACHE_DIR)
+ *  Ogni voce è un file il cui nome è l'hash MD5 della chiave: l'impronta delle opzioni (livello,
+ *  fast-math, CPU, profilo PGO, ..., versione di LLVM) seguita dai testi da cui dipende il risultato.
+ *  Le voci vengono scritte in un file temporaneo e poi rinominate, quindi più kcomp (anche con -j)
+ *  possono condividere la stessa directory.
+ */
+class CompileCache
+{
+public:
+  std::string dir;
+  std::string fingerprint;
+  bool enabled() const { return !dir.empty(); }
+  std::string entry(StringRef kind, ArrayRef<StringRef> parts) const;
+  bool fetch(const std::string &entry, const std::string &dest) const;
+  bool store(const std::string &entry, function_ref<void(raw_ostream &)> write) const;
+};
+
+
+// punto del sorgente contato con --profile (vedi kcompProfileSite in runtime.hpp)
+struct profileSite
+{
+  std::string file;
+  const char *kind;
+  std::string name;
+  int line;
+  GlobalVariable *count;
+  GlobalVariable *cycles;
+};
 
 
 class driver
 {
 public:
   driver();
-  std::map<std::string, AllocaInst *> NamedValues; 
+  std::unique_ptr<LLVMContext> context;
+  std::unique_ptr<Module> module;
+  std::unique_ptr<IRBuilder<>> builder;
+  void inheritOptions(const driver &parent);
+  ASTArena arena;
+  template <typename T, typename... Args>
+  T *make(Args &&...args) { return arena.make<T>(std::forward<Args>(args)...); }
+  SymbolTable NamedValues;
+  StringMap<unsigned> symbolIds;
+  Symbol intern(StringRef name);
+  Function *lookupFunction(const Symbol &S);
+  GlobalVariable *lookupGlobal(const Symbol &S);
+  void bindFunction(const Symbol &S, Function *F);
+  FunctionAST *lookupInline(const Symbol &S) const;
+  void bindInline(const Symbol &S, FunctionAST *F);
+  void bindGlobal(const Symbol &S, GlobalVariable *G);
   RootAST* root; 
   int parse(const std::string &f);
   std::string file;
@@ -42,8 +238,95 @@ public:
   void scan_begin();     
   void scan_end();       
   bool trace_scanning;   
+  void *scanner;
+  char *inputMap;
+  size_t inputLength;
   yy::location location;
   void codegen();
+  unsigned optLevel;
+  bool fastMath;
+  bool fpContractFast;
+  bool builtins;
+  unsigned inlineThreshold;
+  FastMathFlags getFastMathFlags(bool fastFunction) const;
+  void optimizeFunction(Function &F);
+  void optimizeModule();
+  bool deferEmission() const;
+  void emit(GlobalValue *V);
+  BasicBlock *tailRecurse;
+  std::vector<AllocaInst *> tailArgs;
+  std::vector<AllocaInst *> liveArrays;
+  void endArrayLifetimes(size_t from);
+  std::string jitEntry;
+  std::vector<double> jitArgs;
+  std::map<std::string, void *> hostSymbols;
+  void registerSymbol(const std::string &name, void *addr);
+  int jit(double &result);
+  int finish();
+  emitType emitKind;
+  std::string outputFile;
+  std::string cpu;
+  int writeOutput();
+  CompileStats stats;
+  bool timeTrace;
+  bool profile;
+  bool profileCycles;
+  bool pgoGen;
+  std::string pgoGenFile;
+  std::string pgoUse;
+  bool lto;
+  std::vector<std::string> exports;
+  int link(const std::vector<std::string> &inputs);
+  CompileCache cache;
+  int initCache();
+  bool loadCachedOutput(const std::vector<std::string> &sources);
+  std::string sourceText(const yy::location &l);
+  void addCacheContext(const std::string &text);
+  std::string functionCacheEntry(StringRef source) const;
+  Function *loadCachedFunction(const std::string &entry, const Symbol &S);
+  void storeCachedFunction(const std::string &entry, Function *F);
+  profileSite addProfileSite(const char *kind, StringRef name, int line, bool cycles = false);
+  void profileIncrement(GlobalVariable *counter, Value *amount = nullptr);
+
+private:
+  std::vector<Function *> functions;
+  std::vector<GlobalVariable *> globals;
+  std::vector<FunctionAST *> inlineBodies;
+  std::string getOutputFile() const;
+  void storeCachedOutput();
+  std::string outputEntry;
+  std::string cacheContext;
+  std::vector<size_t> lineStarts;
+  std::unique_ptr<TargetMachine> TM;
+  bool initTarget();
+  std::unique_ptr<PassBuilder> PB;
+  LoopAnalysisManager LAM;
+  FunctionAnalysisManager FAM;
+  CGSCCAnalysisManager CGAM;
+  ModuleAnalysisManager MAM;
+  FunctionPassManager FPM;
+  PassInstrumentationCallbacks PIC;
+  std::unique_ptr<StandardInstrumentations> SI;
+  void initOptimizer();
+  std::vector<profileSite> profileSites;
+  void emitProfileTable();
+};
+
+/*  Scope di un blocco
+ *  Apre uno scope nella symbol table e ricorda quanti array locali sono vivi; alla distruzione,
+ *  anche quando la generazione si interrompe per un errore, chiude lo scope e dimentica gli
+ *  array dichiarati nel blocco.
+ */
+class BlockScope
+{
+private:
+  driver &drv;
+  size_t arrays;
+
+public:
+  BlockScope(driver &drv);
+  ~BlockScope();
+  size_t firstArray() const { return arrays; };
 };
 
 typedef std::variant<std::string, double> lexval;
@@ -60,43 +343,57 @@ enum initType
 
 class RootAST
 {
+protected:
+  int line = 0; // riga del sorgente, per --profile
+
 public:
+  void setLine(int l) { line = l; };
   virtual ~RootAST() {};
   virtual lexval getLexVal() const { return NONE; };
   virtual Value *codegen(driver &drv) { return nullptr; };
+  virtual RootAST *simplify(driver &drv) { return this; };
 };
 
 
 class SeqAST : public RootAST
 {
 private:
-  RootAST *first;
-  RootAST *continuation;
+  std::vector<RootAST *> items;
 
 public:
-  SeqAST(RootAST *first, RootAST *continuation);
+  SeqAST();
+  void append(RootAST *item);
   Value *codegen(driver &drv) override;
+  SeqAST *simplify(driver &drv) override;
 };
 
 
 class StmtAST : public RootAST
 {
+public:
+  StmtAST *simplify(driver &drv) override { return this; };
+  virtual bool markTailCalls(unsigned self) { return false; };
 };
 
 
 class InitAST : public StmtAST
 {
 private:
-  std::string Name;
+  Symbol Name;
 
 public:
-  virtual std::string &getName();
+  virtual Symbol &getName();
   virtual initType getType();
+  InitAST *simplify(driver &drv) override { return this; };
 };
 
 
 class ExprAST : public StmtAST
 {
+public:
+  ExprAST *simplify(driver &drv) override { return this; };
+  virtual bool isNumber(double &V) const { return false; };
+  virtual int getBranchHint() const { return 0; };
 };
 
 
@@ -109,19 +406,21 @@ public:
   NumberExprAST(double Val);
   lexval getLexVal() const override;
   Value *codegen(driver &drv) override;
+  bool isNumber(double &V) const override;
 };
 
 
 class VariableExprAST : public ExprAST
 {
 private:
-  std::string Name;
+  Symbol Name;
   ExprAST *Exp;
 
 public:
-  VariableExprAST(const std::string &Name, ExprAST *Exp = nullptr);
+  VariableExprAST(Symbol Name, ExprAST *Exp = nullptr);
   lexval getLexVal() const override;
   Value *codegen(driver &drv) override;
+  ExprAST *simplify(driver &drv) override;
 };
 
 
@@ -135,19 +434,24 @@ private:
 public:
   BinaryExprAST(char Op, ExprAST *LHS, ExprAST *RHS);
   Value *codegen(driver &drv) override;
+  ExprAST *simplify(driver &drv) override;
+  int getBranchHint() const override;
 };
 
 
 class CallExprAST : public ExprAST
 {
 private:
-  std::string Callee;
+  Symbol Callee;
   std::vector<ExprAST *> Args; 
+  bool tail;
 
 public:
-  CallExprAST(std::string Callee, std::vector<ExprAST *> Args);
+  CallExprAST(Symbol Callee, std::vector<ExprAST *> Args);
   lexval getLexVal() const override;
   Value *codegen(driver &drv) override;
+  ExprAST *simplify(driver &drv) override;
+  bool markTailCalls(unsigned self) override;
 };
 
 class IfExprAST : public ExprAST
@@ -160,6 +464,8 @@ private:
 public:
   IfExprAST(ExprAST *cond, ExprAST *trueexp, ExprAST *falseexp);
   Value *codegen(driver &drv) override;
+  ExprAST *simplify(driver &drv) override;
+  bool markTailCalls(unsigned self) override;
 };
 
 
@@ -173,47 +479,53 @@ public:
   BlockAST(std::vector<InitAST *> Def, std::vector<StmtAST *> Stmts);
   BlockAST(std::vector<StmtAST *> Stmts);
   Value *codegen(driver &drv) override;
+  ExprAST *simplify(driver &drv) override;
+  bool markTailCalls(unsigned self) override;
 };
 
 
 class VarBindingsAST : public InitAST
 {
 private:
-  std::string Name;
+  Symbol Name;
   ExprAST *Val;
+  double Size;
 
 public:
-  VarBindingsAST(std::string Name, ExprAST *Val);
+  VarBindingsAST(Symbol Name, ExprAST *Val, double Size = -1);
   AllocaInst *codegen(driver &drv) override;
+  InitAST *simplify(driver &drv) override;
   initType getType() override;
-  std::string &getName() override;
+  Symbol &getName() override;
 };
 
 
 class AssignmentExprAST : public InitAST
 {
 private:
-  std::string Name;
+  Symbol Name;
   ExprAST *Val;
+  ExprAST *Exp;
 
 public:
-  AssignmentExprAST(std::string Name, ExprAST *Val);
+  AssignmentExprAST(Symbol Name, ExprAST *Val, ExprAST *Exp = nullptr);
   Value *codegen(driver &drv) override;
+  AssignmentExprAST *simplify(driver &drv) override;
   initType getType() override;
-  std::string &getName() override;
+  Symbol &getName() override;
 };
 
 
 class GlobalVariableAST : public RootAST
 {
 private:
-  std::string Name;
+  Symbol Name;
   double Size;
 
 public:
-  GlobalVariableAST(std::string Name, double Size = -1);
+  GlobalVariableAST(Symbol Name, double Size = -1);
   Value *codegen(driver &drv) override;
-  std::string &getName();
+  Symbol &getName();
 };
 
 
@@ -228,6 +540,7 @@ public:
   IfStmtAST(ExprAST *cond, StmtAST *trueblock, StmtAST *falseblock);
   IfStmtAST(ExprAST *cond, StmtAST *trueblock);
   Value *codegen(driver &drv) override;
+  StmtAST *simplify(driver &drv) override;
 };
 
 
@@ -238,23 +551,42 @@ private:
   ExprAST *cond;
   AssignmentExprAST *step;
   StmtAST *body;
+  loopHints hints;
+
+public:
+  ForStmtAST(InitAST *init, ExprAST *cond, AssignmentExprAST *step, StmtAST *body, loopHints hints = loopHints());
+  Value *codegen(driver &drv) override;
+  StmtAST *simplify(driver &drv) override;
+};
+
+/// ParForStmtAST - Ciclo parallelo: il corpo viene estratto in una funzione eseguita dal runtime
+class ParForStmtAST : public StmtAST
+{
+private:
+  Symbol Var;
+  ExprAST *start;
+  ExprAST *end;
+  StmtAST *body;
+  loopHints hints;
 
 public:
-  ForStmtAST(InitAST *init, ExprAST *cond, AssignmentExprAST *step, StmtAST *body);
+  ParForStmtAST(Symbol Var, ExprAST *start, ExprAST *end, StmtAST *body, loopHints hints = loopHints());
   Value *codegen(driver &drv) override;
+  StmtAST *simplify(driver &drv) override;
 };
 
 
 class PrototypeAST : public RootAST
 {
 private:
-  std::string Name;
-  std::vector<std::string> Args;
+  Symbol Name;
+  std::vector<Symbol> Args;
   bool emitcode;
 
 public:
-  PrototypeAST(std::string Name, std::vector<std::string> Args);
-  const std::vector<std::string> &getArgs() const;
+  PrototypeAST(Symbol Name, std::vector<Symbol> Args);
+  const Symbol &getName() const;
+  const std::vector<Symbol> &getArgs() const;
   lexval getLexVal() const override;
   Function *codegen(driver &drv) override;
   void noemit();
@@ -267,10 +599,17 @@ private:
   PrototypeAST *Proto;
   ExprAST *Body;
   bool external;
+  funQualifiers qual;
+  bool selfTailCalls;
+  bool expanding;
+  std::string source;
 
 public:
-  FunctionAST(PrototypeAST *Proto, ExprAST *Body);
+  FunctionAST(PrototypeAST *Proto, ExprAST *Body, funQualifiers qual = funQualifiers());
+  void setSource(std::string text) { source = std::move(text); };
   Function *codegen(driver &drv) override;
+  Value *codegenInline(driver &drv, const std::vector<Value *> &Args);
+  FunctionAST *simplify(driver &drv) override;
 };
 
 #endif // ! DRIVER_HH
@@ -1,16 +1,79 @@
 #include <iostream>
+#include <atomic>
 #include "driver.hpp"
+#include "runtime.hpp"
+#include "llvm/Support/ThreadPool.h"
 
-extern LLVMContext *context;
-extern Module *module;
-extern IRBuilder<> *builder;
+// Compiles one translation unit with its own driver (own context, module and scanner)
+static int
+compileUnit (const driver &options, const std::string &file, CompileStats &total, std::mutex &lock)
+{
+    // Each pool thread records its own trace, merged into the main one when the unit is done
+    if (options.timeTrace)
+        timeTraceProfilerInitialize(0, "kcomp");
+    driver unit;
+    unit.inheritOptions(options);
+    // IR on stderr would interleave between units: each unit writes its own object
+    if (unit.emitKind == EMIT_IR)
+        unit.emitKind = EMIT_OBJECT;
+    int res = 0;
+    if (!unit.loadCachedOutput({file})) {
+        res = unit.parse(file);
+        if (!res) {
+            unit.codegen();
+            res = unit.finish();
+        }
+    }
+    {
+        std::lock_guard<std::mutex> guard (lock);
+        total.merge(unit.stats);
+    }
+    if (options.timeTrace)
+        timeTraceProfilerFinishThread();
+    return res;
+}
+
+// --time-report table on stderr, JSON and Chrome trace files
+static int
+report (driver &drv, bool table, const std::string &jsonFile, const std::string &traceFile)
+{
+    int res = 0;
+    if (table)
+        drv.stats.printTable(errs());
+    if (!jsonFile.empty()) {
+        std::error_code EC;
+        raw_fd_ostream out (jsonFile, EC, sys::fs::OF_None);
+        if (EC) {
+            std::cerr << "cannot open " << jsonFile << ": " << EC.message() << std::endl;
+            res = 1;
+        } else
+            drv.stats.printJSON(out);
+    }
+    if (!traceFile.empty()) {
+        if (Error E = timeTraceProfilerWrite(traceFile, "kcomp")) {
+            std::cerr << toString(std::move(E)) << std::endl;
+            res = 1;
+        }
+        timeTraceProfilerCleanup();
+    }
+    return res;
+}
 
 int 
 main (int argc, char *argv[]) 
 {
     int res = 0;
     driver drv;
+    std::vector<std::string> files;
+    unsigned jobs = 0;
+    bool timeTable = false;
+    std::string timeJson, timeTraceFile;
+    bool link = false;
     int i = 1;
+
+    // Runtime entry points, resolved by the JIT without linking libkrt.a
+    drv.registerSymbol("__kcomp_parfor", (void *) &__kcomp_parfor);
+    drv.registerSymbol("__kcomp_profile_dump", (void *) &__kcomp_profile_dump);
     
     while (i<argc) 
     {
@@ -22,15 +85,196 @@ main (int argc, char *argv[])
         else if (argv[i] == std::string ("-s"))
             drv.trace_scanning = true; 
         
-        //Parsing and creating the AST
-        else  if (!drv.parse(argv[i])) { 
-            // IR generation (on stderr) on AST visit
-            drv.codegen(); 
-        } else
-            res = 1;
+        // Optimization level: -O0 (default) up to -O3
+        else if (argv[i] == std::string ("-O0") || argv[i] == std::string ("-O1") ||
+                 argv[i] == std::string ("-O2") || argv[i] == std::string ("-O3"))
+            drv.optLevel = argv[i][2] - '0';
+        
+        // Fast-math on every function: FastMathFlags, function attributes and the
+        // AST simplifications that ignore signed zeros and NaNs (x+0, 0-x, x*0, x/c)
+        else if (argv[i] == std::string ("--ffast-math"))
+            drv.fastMath = true;
+        
+        // Only allow fusing multiplies and adds into fma
+        else if (argv[i] == std::string ("--fp-contract=fast"))
+            drv.fpContractFast = true;
+        
+        // Keep extern libm functions as plain calls instead of LLVM intrinsics
+        else if (argv[i] == std::string ("-fno-builtin"))
+            drv.builtins = false;
+        
+        // In-process execution: --jit <function> [--arg <value>]...
+        else if (argv[i] == std::string ("--jit") && i+1 < argc)
+            drv.jitEntry = argv[++i];
+        
+        else if (argv[i] == std::string ("--arg") && i+1 < argc)
+            drv.jitArgs.push_back(strtod(argv[++i], nullptr));
+        
+        // Native output: -o <file> (object), -S (assembly), --emit-bc (bitcode)
+        else if (argv[i] == std::string ("-o") && i+1 < argc) {
+            drv.outputFile = argv[++i];
+            if (drv.emitKind == EMIT_IR)
+                drv.emitKind = EMIT_OBJECT;
+        }
+        
+        else if (argv[i] == std::string ("-S"))
+            drv.emitKind = EMIT_ASSEMBLY;
+        
+        else if (argv[i] == std::string ("--emit-bc"))
+            drv.emitKind = EMIT_BITCODE;
+        
+        // Target CPU: -mcpu=<cpu>, -march=<cpu> or -march=native
+        else if (std::string (argv[i]).rfind ("-mcpu=", 0) == 0)
+            drv.cpu = argv[i] + 6;
+        
+        else if (std::string (argv[i]).rfind ("-march=", 0) == 0)
+            drv.cpu = argv[i] + 7;
+        
+        // Parallel compilation: -j <N> compiles every file as an independent unit
+        else if (argv[i] == std::string ("-j") && i+1 < argc)
+            jobs = atoi(argv[++i]);
+        
+        // Compile-time report: table on stderr and/or JSON file, Chrome trace-event file
+        else if (argv[i] == std::string ("--time-report")) {
+            timeTable = true;
+            drv.stats.enabled = true;
+        }
+        
+        else if (std::string (argv[i]).rfind ("--time-report-json=", 0) == 0) {
+            timeJson = argv[i] + 19;
+            drv.stats.enabled = true;
+        }
+        
+        else if (std::string (argv[i]).rfind ("--time-trace=", 0) == 0) {
+            timeTraceFile = argv[i] + 13;
+            drv.timeTrace = true;
+        }
+        
+        // Execution profile: per-function, per-loop and per-branch counters (+ cycles)
+        else if (argv[i] == std::string ("--profile"))
+            drv.profile = true;
+        
+        else if (argv[i] == std::string ("--profile=cycles"))
+            drv.profile = drv.profileCycles = true;
+        
+        // Profile-guided optimization: instrument, then rebuild with the merged profile
+        else if (argv[i] == std::string ("--pgo-gen"))
+            drv.pgoGen = true;
+        
+        else if (std::string (argv[i]).rfind ("--pgo-gen=", 0) == 0) {
+            drv.pgoGen = true;
+            drv.pgoGenFile = argv[i] + 10;
+        }
+        
+        else if (std::string (argv[i]).rfind ("--pgo-use=", 0) == 0)
+            drv.pgoUse = argv[i] + 10;
+        
+        // AST inliner: functions up to N unoptimized IR instructions (0 = only "def inline")
+        else if (std::string (argv[i]).rfind ("--inline-threshold=", 0) == 0)
+            drv.inlineThreshold = atoi(argv[i] + 19);
+        
+        // Link-time optimization: --lto writes bitcode, --link merges it and optimizes the whole program
+        else if (argv[i] == std::string ("--lto"))
+            drv.lto = true;
+        
+        else if (argv[i] == std::string ("--link"))
+            link = true;
+        
+        else if (argv[i] == std::string ("--export") && i+1 < argc)
+            drv.exports.push_back(argv[++i]);
+        
+        // On-disk compilation cache (also enabled by KCOMP_CACHE_DIR)
+        else if (std::string (argv[i]).rfind ("--cache-dir=", 0) == 0)
+            drv.cache.dir = argv[i] + 12;
+        
+        else
+            files.push_back(argv[i]);
         
         i++;
     };
 
-    return res;
+    if (drv.pgoGen && (!drv.pgoUse.empty() || !drv.jitEntry.empty())) {
+        std::cerr << "--pgo-gen cannot be combined with --pgo-use or --jit" << std::endl;
+        return 1;
+    }
+    if (!drv.pgoUse.empty()) {
+        if (!sys::fs::exists(drv.pgoUse)) {
+            std::cerr << "profile not found: " << drv.pgoUse << std::endl;
+            return 1;
+        }
+        // The profile is applied by the optimization pipeline: -O0 becomes -O2
+        if (drv.optLevel == 0)
+            drv.optLevel = 2;
+    }
+
+    if ((drv.lto || link) && !drv.jitEntry.empty()) {
+        std::cerr << "--lto and --link cannot be combined with --jit" << std::endl;
+        return 1;
+    }
+    // Compile stage of LTO: always bitcode, optimized only up to the pre-link pipeline
+    if (drv.lto)
+        drv.emitKind = EMIT_BITCODE;
+
+    if (drv.cache.dir.empty() && getenv("KCOMP_CACHE_DIR"))
+        drv.cache.dir = getenv("KCOMP_CACHE_DIR");
+    if (drv.initCache())
+        return 1;
+
+    if (drv.timeTrace)
+        timeTraceProfilerInitialize(0, argv[0]);
+
+    if (link) {
+        if (drv.emitKind == EMIT_IR)
+            drv.emitKind = EMIT_OBJECT;
+        {
+            PhaseTimer timer (drv.stats, "total");
+            res = drv.link(files);
+        }
+        return report(drv, timeTable, timeJson, timeTraceFile) || res;
+    }
+
+    if (jobs > 0) {
+        if (!drv.jitEntry.empty() || (!drv.outputFile.empty() && files.size() > 1)) {
+            std::cerr << "-j cannot be combined with --jit or with -o on several files" << std::endl;
+            return 1;
+        }
+        // compileUnit switches IR on stderr to objects: say so instead of doing it silently
+        if (drv.emitKind == EMIT_IR)
+            std::cerr << "note: -j without -o, -S or --emit-bc writes an object file next to each source"
+                      << std::endl;
+        std::atomic<int> failed (0);
+        std::mutex statsLock;
+        {
+            PhaseTimer timer (drv.stats, "total");
+            ThreadPool pool (hardware_concurrency (jobs));
+            for (auto &file : files)
+                pool.async([&drv, &failed, &file, &statsLock] {
+                    if (compileUnit(drv, file, drv.stats, statsLock))
+                        failed = 1;
+                });
+            pool.wait();
+        }
+        return report(drv, timeTable, timeJson, timeTraceFile) || failed;
+    }
+
+    {
+        PhaseTimer timer (drv.stats, "total");
+        // Cached output of the same sources and options: copied without parsing
+        if (!drv.loadCachedOutput(files)) {
+            for (auto &file : files) {
+                //Parsing and creating the AST
+                if (!drv.parse(file)) { 
+                    // IR generation (on stderr) on AST visit
+                    drv.codegen(); 
+                } else
+                    res = 1;
+            }
+
+            // Whole-module stage: optimization, then printing or JIT execution
+            if (!res)
+                res = drv.finish();
+        }
+    }
+
+    return report(drv, timeTable, timeJson, timeTraceFile) || res;
 }
@@ -10,6 +10,29 @@
 %code requires {
   # include <string>
   # include <exception>
+  # include "llvm/ADT/StringRef.h"
+
+  // identificatore internato dallo scanner: indice nella tabella del driver e nome stabile
+  struct Symbol
+  {
+    unsigned id;
+    llvm::StringRef name;
+  };
+
+  // suggerimenti per l'ottimizzatore scritti dopo "for": vectorize(n) unroll(n); 0 = nessuna indicazione
+  struct loopHints
+  {
+    unsigned vectorize = 0;
+    unsigned unroll = 0;
+  };
+
+  // qualificatori scritti dopo "def": fast (fast-math) e inline (sempre espansa nei chiamanti)
+  struct funQualifiers
+  {
+    bool fast = false;
+    bool inlined = false;
+  };
+
   class driver;
   class RootAST;
   class ExprAST;
@@ -27,6 +50,7 @@
   class IfStmtAST;
   class InitAST;
   class ForStmtAST;
+  class ParForStmtAST;
 }
 
 // The parsing context.
@@ -67,16 +91,23 @@
   AND        "and"
   OR         "or"
   NOT        "not"
+  LIKELY     "likely"
+  UNLIKELY   "unlikely"
   EXTERN     "extern"
   DEF        "def"
+  FAST       "fast"
+  INLINE     "inline"
   VAR        "var"
   GLOBAL     "global"
   IF         "if"
   ELSE       "else"
   FOR        "for"
+  PARFOR     "parfor"
+  VECTORIZE  "vectorize"
+  UNROLL     "unroll"
 ;
 
-%token <std::string> IDENTIFIER "id"
+%token <Symbol> IDENTIFIER "id"
 %token <double> NUMBER "number"
 %type <ExprAST*> exp
 %type <ExprAST*> idexp
@@ -86,12 +117,12 @@
 %type <ExprAST*> condexp
 %type <std::vector<ExprAST*>> optexp
 %type <std::vector<ExprAST*>> explist
-%type <RootAST*> program
+%type <SeqAST*> program
 %type <RootAST*> top
 %type <FunctionAST*> definition
 %type <PrototypeAST*> external
 %type <PrototypeAST*> proto
-%type <std::vector<std::string>> idseq
+%type <std::vector<Symbol>> idseq
 %type <BlockAST*> block
 %type <std::vector<InitAST*>> vardefs;
 %type <std::vector<StmtAST*>> stmts;
@@ -102,6 +133,9 @@
 %type <AssignmentExprAST*> assignment;
 %type <InitAST*> init;
 %type <ForStmtAST*> forstmt;
+%type <ParForStmtAST*> parforstmt;
+%type <loopHints> forhints;
+%type <funQualifiers> funqual;
 %%
 %start startsymb;
 
@@ -109,8 +143,8 @@ startsymb:
 program                 { drv.root = $1; }
 
 program:
-  %empty                { $$ = new SeqAST(nullptr,nullptr); }
-|  top ";" program      { $$ = new SeqAST($1,$3); };
+  %empty                { $$ = drv.make<SeqAST>(); }
+| program top ";"       { $1->append($2); $$ = $1; };
 
 top:
 %empty                  { $$ = nullptr; }
@@ -119,44 +153,52 @@ top:
 | globalvar             { $$ = $1; };
 
 definition:
-  "def" proto block       { $$ = new FunctionAST($2,$3); $2->noemit(); };
+  "def" funqual proto block { $$ = drv.make<FunctionAST>($3,$4,$2); $3->noemit(); $$->setLine(@1.begin.line);
+                              $$->setSource(drv.sourceText(@$)); };
+
+funqual:
+  %empty                { }
+| funqual "fast"        { $1.fast = true; $$ = $1; }
+| funqual "inline"      { $1.inlined = true; $$ = $1; };
 
 external:
   "extern" proto        { $$ = $2; };
 
 proto:
-  "id" "(" idseq ")"    { $$ = new PrototypeAST($1,$3);  };
+  "id" "(" idseq ")"    { $$ = drv.make<PrototypeAST>($1,std::move($3));  };
 
 globalvar:
-  "global" "id"                   { $$ = new GlobalVariableAST($2); }
-| "global" "id" "[" "number" "]"  { $$ = new GlobalVariableAST($2,$4); };
+  "global" "id"                   { $$ = drv.make<GlobalVariableAST>($2); }
+| "global" "id" "[" "number" "]"  { $$ = drv.make<GlobalVariableAST>($2,$4); };
 
 
 idseq:
-  %empty                { std::vector<std::string> args; $$ = args; }
-| "id" idseq            { $2.insert($2.begin(),$1); $$ = $2; };
+  %empty                { }
+| idseq "id"            { $1.push_back($2); $$ = std::move($1); };
 
 stmts:
-  stmt                  {std::vector<StmtAST*> statemets; statemets.insert(statemets.begin(),$1); $$ = statemets; }
-| stmt ";" stmts        {$3.insert($3.begin(),$1); $$ = $3;};
+  stmt                  { $$.push_back($1); }
+| stmts ";" stmt        { $1.push_back($3); $$ = std::move($1); };
 
 stmt:
   assignment            {$$ = $1;}
 | block                 {$$ = $1;}
 | ifstmt                {$$ = $1;}
 | forstmt               {$$ = $1;}
+| parforstmt            {$$ = $1;}
 | exp                   {$$ = $1;};
 
 assignment:
-  "id" "=" exp              {$$ = new AssignmentExprAST($1,$3);}
-| "++" "id"                 {$$ = new AssignmentExprAST($2, new BinaryExprAST('+',new VariableExprAST($2),new NumberExprAST(1)));}
-| "id" "++"                 {$$ = new AssignmentExprAST($1, new BinaryExprAST('+',new VariableExprAST($1),new NumberExprAST(1)));}
-| "--" "id"                 {$$ = new AssignmentExprAST($2, new BinaryExprAST('-',new VariableExprAST($2),new NumberExprAST(1)));}
-| "id" "--"                 {$$ = new AssignmentExprAST($1, new BinaryExprAST('-',new VariableExprAST($1),new NumberExprAST(1)));}
+  "id" "=" exp              {$$ = drv.make<AssignmentExprAST>($1,$3);}
+| "id" "[" exp "]" "=" exp  {$$ = drv.make<AssignmentExprAST>($1,$6,$3);}
+| "++" "id"                 {$$ = drv.make<AssignmentExprAST>($2, drv.make<BinaryExprAST>('+',drv.make<VariableExprAST>($2),drv.make<NumberExprAST>(1)));}
+| "id" "++"                 {$$ = drv.make<AssignmentExprAST>($1, drv.make<BinaryExprAST>('+',drv.make<VariableExprAST>($1),drv.make<NumberExprAST>(1)));}
+| "--" "id"                 {$$ = drv.make<AssignmentExprAST>($2, drv.make<BinaryExprAST>('-',drv.make<VariableExprAST>($2),drv.make<NumberExprAST>(1)));}
+| "id" "--"                 {$$ = drv.make<AssignmentExprAST>($1, drv.make<BinaryExprAST>('-',drv.make<VariableExprAST>($1),drv.make<NumberExprAST>(1)));}
 
 block:
-  "{" stmts "}"             { $$ = new BlockAST($2); } 
-| "{" vardefs ";" stmts "}" { $$ = new BlockAST($2,$4); };
+  "{" stmts "}"             { $$ = drv.make<BlockAST>(std::move($2)); } 
+| "{" vardefs ";" stmts "}" { $$ = drv.make<BlockAST>(std::move($2),std::move($4)); };
 
 
 %left ":" "?";
@@ -167,40 +209,50 @@ block:
 %left "*" "/";
 
 exp:
- "-" exp                { $$ = new BinaryExprAST('-',new NumberExprAST(0),$2);}
-|  exp "+" exp          { $$ = new BinaryExprAST('+',$1,$3); }
-| exp "-" exp           { $$ = new BinaryExprAST('-',$1,$3); }
-| exp "*" exp           { $$ = new BinaryExprAST('*',$1,$3); }
-| exp "/" exp           { $$ = new BinaryExprAST('/',$1,$3); }
+ "-" exp                { $$ = drv.make<BinaryExprAST>('-',nullptr,$2);}
+|  exp "+" exp          { $$ = drv.make<BinaryExprAST>('+',$1,$3); }
+| exp "-" exp           { $$ = drv.make<BinaryExprAST>('-',$1,$3); }
+| exp "*" exp           { $$ = drv.make<BinaryExprAST>('*',$1,$3); }
+| exp "/" exp           { $$ = drv.make<BinaryExprAST>('/',$1,$3); }
 | idexp                 { $$ = $1; }
 | "(" exp ")"           { $$ = $2; }
-| "number"              { $$ = new NumberExprAST($1); }
+| "number"              { $$ = drv.make<NumberExprAST>($1); }
 | expif                 { $$ = $1; };
 
 
 vardefs:
-  binding               { std::vector<InitAST*> definitions; definitions.push_back($1); $$ = definitions; }
-| vardefs ";" binding   { $1.push_back($3); $$ = $1; };
+  binding               { $$.push_back($1); }
+| vardefs ";" binding   { $1.push_back($3); $$ = std::move($1); };
 
 binding:
-  "var" "id" initexp                                { $$ = new VarBindingsAST($2,$3); };
+  "var" "id" initexp                                { $$ = drv.make<VarBindingsAST>($2,$3); }
+| "var" "id" "[" "number" "]"                       { $$ = drv.make<VarBindingsAST>($2,nullptr,$4); };
 
 initexp:
   %empty  {$$ = nullptr;}
 | "=" exp {$$ = $2;};
 
 expif:
-  condexp "?" exp ":" exp { $$ = new IfExprAST($1,$3,$5);};
+  condexp "?" exp ":" exp { $$ = drv.make<IfExprAST>($1,$3,$5);};
 
 
 %right "then" "else" ;
 
 ifstmt :
-  "if" "(" condexp ")" stmt                   {$$ = new IfStmtAST($3,$5); } %prec "then"
-| "if" "(" condexp ")" stmt "else" stmt       {$$ = new IfStmtAST($3,$5,$7); }; 
+  "if" "(" condexp ")" stmt                   {$$ = drv.make<IfStmtAST>($3,$5); $$->setLine(@1.begin.line); } %prec "then"
+| "if" "(" condexp ")" stmt "else" stmt       {$$ = drv.make<IfStmtAST>($3,$5,$7); $$->setLine(@1.begin.line); }; 
 
 forstmt :
-"for" "(" init ";" condexp ";" assignment ")" stmt {$$ = new ForStmtAST($3,$5,$7,$9);};
+"for" forhints "(" init ";" condexp ";" assignment ")" stmt {$$ = drv.make<ForStmtAST>($4,$6,$8,$10,$2); $$->setLine(@1.begin.line);};
+
+// le iterazioni i = start, ..., end-1 vengono distribuite sui thread del runtime
+parforstmt :
+"parfor" forhints "(" "id" "=" exp "," exp ")" stmt {$$ = drv.make<ParForStmtAST>($4,$6,$8,$10,$2); $$->setLine(@1.begin.line);};
+
+forhints :
+  %empty                              { }
+| forhints "vectorize" "(" "number" ")" { $1.vectorize = $4; $$ = $1; }
+| forhints "unroll" "(" "number" ")"    { $1.unroll = $4; $$ = $1; };
 
 init :
   binding {$$ = $1;}
@@ -208,32 +260,30 @@ init :
 
 condexp:
   relexp                 {$$ = $1;}
-| relexp "and" condexp   {$$ = new BinaryExprAST('a',$1,$3);}
-| relexp "or" condexp    {$$ = new BinaryExprAST('o',$1,$3);}
-| "not" condexp          {$$ = new BinaryExprAST('n',nullptr,$2);}
+| relexp "and" condexp   {$$ = drv.make<BinaryExprAST>('a',$1,$3);}
+| relexp "or" condexp    {$$ = drv.make<BinaryExprAST>('o',$1,$3);}
+| "not" condexp          {$$ = drv.make<BinaryExprAST>('n',nullptr,$2);}
+| "likely" "(" condexp ")"   {$$ = drv.make<BinaryExprAST>('l',nullptr,$3);}
+| "unlikely" "(" condexp ")" {$$ = drv.make<BinaryExprAST>('u',nullptr,$3);}
 | "(" condexp ")"        {$$ = $2;};
 
 relexp:
-  exp "<" exp            { $$ = new BinaryExprAST('<',$1,$3); }
-|  exp ">" exp           { $$ = new BinaryExprAST('>',$1,$3); }
-| exp "==" exp           { $$ = new BinaryExprAST('=',$1,$3); };
+  exp "<" exp            { $$ = drv.make<BinaryExprAST>('<',$1,$3); }
+|  exp ">" exp           { $$ = drv.make<BinaryExprAST>('>',$1,$3); }
+| exp "==" exp           { $$ = drv.make<BinaryExprAST>('=',$1,$3); };
 
 idexp:
-  "id"                  { $$ = new VariableExprAST($1); }
-| "id" "(" optexp ")"   { $$ = new CallExprAST($1,$3); };
-| "id" "[" exp "]"      { $$ = new VariableExprAST($1,$3);}
+  "id"                  { $$ = drv.make<VariableExprAST>($1); }
+| "id" "(" optexp ")"   { $$ = drv.make<CallExprAST>($1,std::move($3)); };
+| "id" "[" exp "]"      { $$ = drv.make<VariableExprAST>($1,$3);}
 
 optexp:
-  %empty                { std::vector<ExprAST*> args;
-			 $$ = args; }
-| explist               { $$ = $1; };
+  %empty                { }
+| explist               { $$ = std::move($1); };
 
 explist:
-  exp                   { std::vector<ExprAST*> args;
-                          args.push_back($1);
-			                    $$ = args;
-                        }
-| exp "," explist       { $3.insert($3.begin(), $1); $$ = $3; };
+  exp                   { $$.push_back($1); }
+| explist "," exp       { $1.push_back($3); $$ = std::move($1); };
  
 %%
 
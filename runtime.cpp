@@ -0,0 +1,236 @@
+#include "runtime.hpp"
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <atomic>
+#include <condition_variable>
+#include <cstdlib>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+/*  Pool di thread con work stealing
+ *  L'intervallo di un parfor viene diviso in chunk di iterazioni contigue, distribuiti a blocchi
+ *  sulle code dei thread (la coda 0 appartiene al thread chiamante, che partecipa al lavoro).
+ *  Ogni thread consuma la propria coda dalla testa; quando è vuota ruba dalla coda
+ *  degli altri thread, partendo dal fondo, così i chunk rubati sono i più lontani da chi li possiede.
+ *
+ *  Un parfor annidato (chiamato dal corpo di un altro parfor) viene eseguito in sequenza
+ *  dal thread che lo incontra. Il numero di thread si sceglie con la variabile d'ambiente
+ *  KCOMP_THREADS; in sua assenza si usano tutti i core.
+ */
+namespace
+{
+  typedef std::pair<int64_t, int64_t> chunk;
+
+  struct workQueue
+  {
+    std::mutex lock;
+    std::deque<chunk> chunks;
+  };
+
+  thread_local bool inParfor = false;
+
+  class threadPool
+  {
+  private:
+    unsigned size;
+    std::vector<std::thread> threads;
+    std::vector<workQueue> queues;
+    std::mutex lock;
+    std::condition_variable wake;
+    std::condition_variable done;
+    std::mutex jobLock;
+    parforBody body;
+    double *env;
+    std::atomic<int64_t> remaining;
+    unsigned generation;
+    bool stopping;
+
+    bool next(unsigned self, chunk &c);
+    void work(unsigned self);
+    void loop(unsigned self);
+
+  public:
+    threadPool(unsigned size);
+    ~threadPool();
+    void run(parforBody body, double *env, int64_t start, int64_t end);
+  };
+
+  threadPool::threadPool(unsigned size) : size(size), queues(size), body(nullptr), env(nullptr),
+                                          remaining(0), generation(0), stopping(false)
+  {
+    for (unsigned i = 1; i < size; i++)
+      threads.emplace_back(&threadPool::loop, this, i);
+  }
+
+  threadPool::~threadPool()
+  {
+    {
+      std::lock_guard<std::mutex> l(lock);
+      stopping = true;
+    }
+    wake.notify_all();
+    for (auto &t : threads)
+      t.join();
+  }
+
+  bool threadPool::next(unsigned self, chunk &c)
+  {
+    {
+      std::lock_guard<std::mutex> l(queues[self].lock);
+      if (!queues[self].chunks.empty())
+      {
+        c = queues[self].chunks.front();
+        queues[self].chunks.pop_front();
+        return true;
+      }
+    }
+    for (unsigned i = 1; i < size; i++)
+    {
+      workQueue &victim = queues[(self + i) % size];
+      std::lock_guard<std::mutex> l(victim.lock);
+      if (!victim.chunks.empty())
+      {
+        c = victim.chunks.back();
+        victim.chunks.pop_back();
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void threadPool::work(unsigned self)
+  {
+    chunk c;
+    while (next(self, c))
+    {
+      body(env, c.first, c.second);
+      if (remaining.fetch_sub(1) == 1)
+      {
+        std::lock_guard<std::mutex> l(lock);
+        done.notify_all();
+      }
+    }
+  }
+
+  void threadPool::loop(unsigned self)
+  {
+    inParfor = true;
+    unsigned seen = 0;
+    for (;;)
+    {
+      {
+        std::unique_lock<std::mutex> l(lock);
+        wake.wait(l, [&]
+                  { return stopping || generation != seen; });
+        if (stopping)
+          return;
+        seen = generation;
+      }
+      work(self);
+    }
+  }
+
+  void threadPool::run(parforBody body, double *env, int64_t start, int64_t end)
+  {
+    int64_t total = end - start;
+    if (inParfor || size == 1 || total < 2)
+    {
+      if (total > 0)
+        body(env, start, end);
+      return;
+    }
+
+    std::lock_guard<std::mutex> job(jobLock);
+    int64_t count = std::min<int64_t>(total, (int64_t)size * 8);
+    int64_t grain = (total + count - 1) / count;
+    count = (total + grain - 1) / grain;
+    {
+      std::lock_guard<std::mutex> l(lock);
+      this->body = body;
+      this->env = env;
+      remaining = count;
+    }
+
+    // chunk contigui a blocchi: il thread i parte dalla i-esima porzione dell'intervallo
+    int64_t perQueue = (count + size - 1) / size;
+    for (int64_t i = 0; i < count; i++)
+    {
+      workQueue &q = queues[i / perQueue];
+      std::lock_guard<std::mutex> l(q.lock);
+      q.chunks.emplace_back(start + i * grain, std::min(end, start + (i + 1) * grain));
+    }
+    {
+      std::lock_guard<std::mutex> l(lock);
+      generation++;
+    }
+    wake.notify_all();
+
+    inParfor = true;
+    work(0);
+    inParfor = false;
+
+    std::unique_lock<std::mutex> l(lock);
+    done.wait(l, [&]
+              { return remaining == 0; });
+  }
+
+  unsigned poolSize()
+  {
+    if (const char *env = getenv("KCOMP_THREADS"))
+      if (int n = atoi(env); n > 0)
+        return n;
+    return std::max(1u, std::thread::hardware_concurrency());
+  }
+
+  threadPool &pool()
+  {
+    static threadPool instance(poolSize());
+    return instance;
+  }
+}
+
+void __kcomp_parfor(parforBody body, double *env, int64_t start, int64_t end)
+{
+  pool().run(body, env, start, end);
+}
+
+/*  Profilo (--profile)
+ *  Ogni modulo compilato con --profile passa qui, all'uscita del programma, la propria tabella
+ *  dei punti contati, che viene stampata nell'ordine del sorgente su stderr,
+ *  o in coda al file indicato dalla variabile d'ambiente KCOMP_PROFILE.
+ */
+void __kcomp_profile_dump(const kcompProfileSite *sites, int64_t n)
+{
+  FILE *out = stderr;
+  if (const char *path = getenv("KCOMP_PROFILE"))
+    if (FILE *f = fopen(path, "a"))
+      out = f;
+
+  std::vector<const kcompProfileSite *> order;
+  for (int64_t i = 0; i < n; i++)
+    order.push_back(&sites[i]);
+  std::stable_sort(order.begin(), order.end(), [](const kcompProfileSite *a, const kcompProfileSite *b)
+                   {
+    int c = strcmp(a->file, b->file);
+    return c < 0 || (c == 0 && a->line < b->line); });
+
+  fprintf(out, "=== kcomp profile ===\n");
+  fprintf(out, "%-24s %-10s %-20s %16s %20s\n", "location", "kind", "name", "count", "cycles");
+  for (const kcompProfileSite *s : order)
+  {
+    char location[256];
+    snprintf(location, sizeof(location), "%s:%" PRId64, s->file, s->line);
+    fprintf(out, "%-24s %-10s %-20s %16" PRIu64, location, s->kind, s->name, *s->count);
+    if (s->cycles)
+      fprintf(out, " %20" PRIu64, *s->cycles);
+    fprintf(out, "\n");
+  }
+  if (out != stderr)
+    fclose(out);
+}
@@ -0,0 +1,33 @@
+#ifndef RUNTIME_HPP
+#define RUNTIME_HPP
+
+#include <cstdint>
+
+/*  Runtime di kcomp
+ *  Funzioni di supporto chiamate dal codice generato; vengono compilate in libkrt.a,
+ *  da collegare ai programmi .k che le usano, e in kcomp stesso per la modalità --jit.
+ */
+extern "C"
+{
+  // corpo di un parfor, estratto in una funzione: esegue le iterazioni [begin, end)
+  typedef void (*parforBody)(double *env, int64_t begin, int64_t end);
+
+  // esegue le iterazioni [start, end) di un parfor sul pool di thread del runtime
+  void __kcomp_parfor(parforBody body, double *env, int64_t start, int64_t end);
+
+  // punto del sorgente contato con --profile: chiamate di funzione, iterazioni di un for, rami di un if
+  struct kcompProfileSite
+  {
+    const char *file;
+    const char *kind;
+    const char *name;
+    int64_t line;
+    uint64_t *count;
+    uint64_t *cycles; // cicli inclusivi (--profile=cycles), solo per le funzioni; altrimenti nullptr
+  };
+
+  // stampa il profilo di un modulo; chiamata dal distruttore globale generato con --profile
+  void __kcomp_profile_dump(const kcompProfileSite *sites, int64_t n);
+}
+
+#endif // ! RUNTIME_HPP
@@ -4,11 +4,15 @@
 # include <cstdlib>
 # include <string>
 # include <cmath>
+# include <fcntl.h>
+# include <sys/mman.h>
+# include <sys/stat.h>
+# include <unistd.h>
 # include "driver.hpp"
 # include "parser.hpp"
 %}
 
-%option noyywrap nounput batch debug noinput
+%option noyywrap nounput batch debug noinput reentrant
 
 id      [a-zA-Z][a-zA-Z_0-9]*
 fpnum   [0-9]*\.?[0-9]+([eE][-+]?[0-9]+)?
@@ -51,6 +55,8 @@ blank   [ \t]
 "and"    return yy::parser::make_AND       (loc);
 "or"     return yy::parser::make_OR        (loc);
 "not"    return yy::parser::make_NOT       (loc);
+"likely"   return yy::parser::make_LIKELY   (loc);
+"unlikely" return yy::parser::make_UNLIKELY (loc);
 
 
 {num}    { errno = 0;
@@ -68,8 +74,13 @@ blank   [ \t]
 "if"     { return yy::parser::make_IF(loc); }
 "else"   { return yy::parser::make_ELSE(loc);}
 "for"    { return yy::parser::make_FOR(loc); }
+"fast"   { return yy::parser::make_FAST(loc); }
+"inline" { return yy::parser::make_INLINE(loc); }
+"parfor" { return yy::parser::make_PARFOR(loc); }
+"vectorize" { return yy::parser::make_VECTORIZE(loc); }
+"unroll" { return yy::parser::make_UNROLL(loc); }
 
-{id}     { return yy::parser::make_IDENTIFIER (yytext, loc); }
+{id}     { return yy::parser::make_IDENTIFIER (drv.intern (StringRef (yytext, yyleng)), loc); }
 
 .        { throw yy::parser::syntax_error
                (loc, "invalid character: " + std::string(yytext));
@@ -78,19 +89,72 @@ blank   [ \t]
 <<EOF>>  { return yy::parser::make_END (loc); }
 %%
 
+yy::parser::symbol_type yylex (driver &drv) {
+  drv.stats.tokens++;
+  return yylex_r (drv, drv.scanner);
+}
+
+/* Il sorgente viene mappato in memoria e scandito sul posto con yy_scan_buffer, senza
+   passare dal buffer stdio di yyin. flex richiede due caratteri nulli in coda al buffer:
+   si riserva una mappatura anonima (azzerata) di due byte più lunga del file, e si mappa
+   il file sopra di essa. La mappatura è privata e scrivibile perché flex termina yytext
+   scrivendo nel buffer. Lo standard input (-) e i file non regolari restano in streaming. */
 void driver::scan_begin () {
-  yy_flex_debug = trace_scanning;
+  FILE *in = nullptr;
+  yylex_init (&scanner);
+  yyset_debug (trace_scanning, scanner);
   if (file.empty () || file == "-")
-    yyin = stdin;
-  else if (!(yyin = fopen (file.c_str (), "r")))
+    in = stdin;
+  else
     {
-      std::cerr << "cannot open " << file << ": " << strerror(errno) << '\n';
-      exit (EXIT_FAILURE);
+      int fd = open (file.c_str (), O_RDONLY);
+      struct stat st;
+      if (fd < 0 || fstat (fd, &st) < 0)
+        {
+          std::cerr << "cannot open " << file << ": " << strerror(errno) << '\n';
+          exit (EXIT_FAILURE);
+        }
+      if (S_ISREG (st.st_mode))
+        {
+          size_t size = st.st_size;
+          inputLength = size + 2;
+          char *base = (char *) mmap (nullptr, inputLength, PROT_READ | PROT_WRITE,
+                                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+          if (base != MAP_FAILED && size > 0
+              && mmap (base, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED)
+            {
+              munmap (base, inputLength);
+              base = (char *) MAP_FAILED;
+            }
+          if (base != MAP_FAILED)
+            {
+              close (fd);
+              inputMap = base;
+              yy_scan_buffer (base, inputLength, scanner);
+              return;
+            }
+        }
+      in = fdopen (fd, "r");
+      if (!in)
+        {
+          std::cerr << "cannot open " << file << ": " << strerror(errno) << '\n';
+          close (fd);
+          exit (EXIT_FAILURE);
+        }
     }
+  yyset_in (in, scanner);
 }
 
 void
 driver::scan_end ()
 {
-  fclose (yyin);
+  if (inputMap)
+    {
+      munmap (inputMap, inputLength);
+      inputMap = nullptr;
+    }
+  else
+    fclose (yyget_in (scanner));
+  yylex_destroy (scanner);
+  scanner = nullptr;
 }
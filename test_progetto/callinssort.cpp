@@ -0,0 +1,23 @@
+#include <iostream>
+#include <ctime>
+
+extern "C" {
+    double randinit(double);
+    double sort(double);
+}
+
+extern "C" {
+    double printval(double);
+}
+
+double printval(double x) {
+    std::cout << x << std::endl;
+    return 0.0;
+}
+
+int main() {
+    std::time_t t = std::time(0);
+    randinit(t);
+    sort(10);
+    return 0;
+}
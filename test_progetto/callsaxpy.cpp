@@ -0,0 +1,19 @@
+#include <iostream>
+
+extern "C" {
+    double saxpy(double, double);
+}
+
+extern "C" {
+    double printval(double);
+}
+
+double printval(double x) {
+    std::cout << x << std::endl;
+    return 0.0;
+}
+
+int main() {
+    saxpy(2, 1000);
+    return 0;
+}